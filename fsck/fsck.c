@@ -0,0 +1,550 @@
+// fsck: check a file system image (kernel/fs/fs.h) offline, and
+// report how fragmented its files are.
+//
+// usage: fsck [-w] [-v] fs.img
+//
+// The image is mapped with mmap() rather than read, so only the
+// blocks the checks touch are ever read in: the inode table, the
+// bitmap, and directory, indirect and extent blocks, not file
+// data.
+//
+// First a committed log is replayed the way recover_from_log()
+// does it at boot. The replay goes to a private copy of the
+// mapping, and the image is left alone, unless -w asks for it to
+// be written back. Then:
+// * every block an inode maps must lie in the data area, belong
+//   to only that inode, and be marked in use in the bitmap, and a
+//   block marked in use that no inode maps is reported as leaked;
+// * an inline inode (I_INLINE) maps no blocks, and must be an
+//   extent-mapped regular file of at most NINLINE bytes;
+// * every directory entry must name an allocated inode, and each
+//   inode's nlink must match the entries naming it (counting
+//   "..", not ".");
+// * a hashed directory (I_HASHDIR) must have a well-formed table
+//   whose entries point at leaves, the entries sharing a leaf
+//   must agree on the leaf's hash bits, every name in a leaf must
+//   hash to them, and block 0 must hold only "." and "..";
+// * every allocated inode must be reachable from the root.
+// Finally, it reports the extents per file (runs of consecutive
+// blocks, however the file maps them) and the average run length,
+// and with -v, every file's.
+// Exits with 1 if it found errors.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kernel/fs/fs.h"
+#include "kernel/fs/log.h"
+
+uint crc32c(uint crc, const void *p, uint n); // kernel/lib/crc.c
+
+uint fsbsize = BSIZEMIN; // BSIZE, from the super block
+
+static char *img;
+static uint64 imgsize;
+static struct superblock sb;
+static uint datastart; // first data block
+static int nerr;
+static int verbose;
+
+// A file's data blocks, in logical order.
+struct blist {
+  uint *b;
+  uint n, cap;
+};
+
+static void die(const char *s) {
+  fprintf(stderr, "fsck: %s\n", s);
+  exit(2);
+}
+
+static void error(const char *fmt, uint a, uint b, uint c) {
+  if (nerr++ < 50) {
+    printf("error: ");
+    printf(fmt, a, b, c);
+    printf("\n");
+  }
+}
+
+static char *blk(uint b) { return img + (uint64)b * BSIZE; }
+
+static struct dinode *dinode(uint inum) {
+  return (struct dinode *)blk(IBLOCK(inum, sb)) + inum % IPB;
+}
+
+static int inuse(uint b) {
+  return (blk(sb.bmapstart + b / BPB)[b % BPB / 8] >> (b % 8)) & 1;
+}
+
+static void bladd(struct blist *l, uint b) {
+  if (l->n == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 64;
+    if ((l->b = realloc(l->b, l->cap * sizeof(uint))) == 0)
+      die("out of memory");
+  }
+  l->b[l->n++] = b;
+}
+
+// Log replay; as in log.c.
+
+static uint logsize; // blocks in the log area
+
+static uint log_block(uint pos) { return sb.logstart + 1 + pos % logsize; }
+
+static uint desc_crc(struct logdesc *d) {
+  uint saved = d->crc, crc;
+
+  d->crc = 0;
+  crc = crc32c(0, d, BSIZE);
+  d->crc = saved;
+  return crc;
+}
+
+// Descriptor k of the transaction at pos, if it belongs to
+// transaction seq; else 0.
+static struct logdesc *read_desc(uint pos, int k, uint64 seq) {
+  struct logdesc *d = (struct logdesc *)blk(log_block(pos + k));
+
+  if (d->magic != LOGMAGIC || d->crc != desc_crc(d) || d->seq != seq ||
+      d->index != k)
+    return 0;
+  if (d->n <= 0 || d->n + LOGDESCS(d->n) > logsize)
+    return 0;
+  return d;
+}
+
+// The number of blocks in the intact transaction seq at pos,
+// or -1.
+static int check_trans(uint pos, uint64 seq) {
+  struct logdesc *d;
+  uint data;
+  int i, n;
+
+  if ((d = read_desc(pos, 0, seq)) == 0)
+    return -1;
+  n = d->n;
+  data = pos + LOGDESCS(n);
+  for (i = 0; i < n; i++) {
+    if (i % LOGDPB == 0 && i > 0) {
+      if ((d = read_desc(pos, i / LOGDPB, seq)) == 0 || d->n != n)
+        return -1;
+    }
+    if (crc32c(0, blk(log_block(data + i)), BSIZE) != d->block[i % LOGDPB].crc)
+      return -1;
+  }
+  return n;
+}
+
+// Install the committed transactions, oldest first, and free
+// the log. Returns the number of transactions.
+static int replay(void) {
+  struct loghead *hb = (struct loghead *)blk(sb.logstart);
+  struct logdesc *d = 0;
+  uint64 seq = hb->seq ? hb->seq : 1;
+  uint pos, data;
+  int i, n, ntrans = 0, nblk = 0;
+
+  logsize = sb.nlog - 1;
+  for (pos = hb->tail; (n = check_trans(pos, seq)) > 0; pos = data + n) {
+    data = pos + LOGDESCS(n);
+    for (i = 0; i < n; i++) {
+      if (i % LOGDPB == 0)
+        d = read_desc(pos, i / LOGDPB, seq);
+      uint dst = d->block[i % LOGDPB].blockno;
+      if (dst < sb.logstart + sb.nlog || dst >= sb.size) {
+        error("log: transaction %u writes block %u", (uint)seq, dst, 0);
+        continue;
+      }
+      memmove(blk(dst), blk(log_block(data + i)), BSIZE);
+      nblk++;
+    }
+    ntrans++;
+    seq++;
+  }
+  if (ntrans > 0) {
+    hb->tail = pos;
+    hb->seq = seq;
+    printf("log: replayed %d transactions, %d blocks\n", ntrans, nblk);
+  }
+  return ntrans;
+}
+
+// Inodes.
+
+static struct blist *files; // per inode: its data blocks
+static uint *owner;         // per block: the inode mapping it
+
+// Block b is mapped by inode inum.
+static void claim(uint inum, uint b) {
+  if (b < datastart || b >= sb.size) {
+    error("inode %u: block %u outside the data area", inum, b, 0);
+    return;
+  }
+  if (owner[b] != 0) {
+    error("block %u: mapped by inodes %u and %u", b, owner[b], inum);
+    return;
+  }
+  owner[b] = inum;
+  if (!inuse(b))
+    error("block %u: mapped by inode %u but free in the bitmap", b, inum, 0);
+}
+
+// Add the blocks under indirect block b, level 0 pointing at
+// data, to inum's list, up to want of them.
+static void walk_ind(uint inum, uint b, int level, uint want) {
+  uint *a = (uint *)blk(b);
+
+  claim(inum, b);
+  if (owner[b] != inum)
+    return;
+  for (uint i = 0; i < NINDIRECT && files[inum].n < want; i++) {
+    if (a[i] == 0)
+      continue;
+    if (level == 0) {
+      claim(inum, a[i]);
+      bladd(&files[inum], a[i]);
+    } else {
+      walk_ind(inum, a[i], level - 1, want);
+    }
+  }
+}
+
+// Add the blocks of the n extents at e, up to one of length 0,
+// to inum's list. Returns how many extents there were.
+static uint walk_extents(uint inum, struct extent *e, uint n) {
+  uint i, j;
+
+  for (i = 0; i < n && e[i].len > 0; i++) {
+    for (j = 0; j < e[i].len; j++) {
+      claim(inum, e[i].start + j);
+      bladd(&files[inum], e[i].start + j);
+    }
+  }
+  return i;
+}
+
+static void walk_inode(uint inum, struct dinode *dip) {
+  uint want = ((uint64)dip->size + BSIZE - 1) / BSIZE;
+  uint i, k, *a;
+
+  if (dip->type == T_DEVICE)
+    return;
+  if (dip->flags & I_INLINE) {
+    if (dip->type != T_FILE || !(dip->flags & I_EXTENTS) ||
+        dip->size > NINLINE)
+      error("inode %u: inline, but type %u and size %u", inum, dip->type,
+            dip->size);
+    return;
+  }
+  if (dip->flags & I_EXTENTS) {
+    // the index block lists extent blocks, each full before the
+    // next, until one of length 0.
+    i = walk_extents(inum, dip->ext.e, NIEXTENT);
+    if (i == NIEXTENT && dip->ext.blk != 0) {
+      claim(inum, dip->ext.blk);
+      a = (uint *)blk(dip->ext.blk);
+      for (k = 0; owner[dip->ext.blk] == inum && k < NINDIRECT && a[k]; k++) {
+        claim(inum, a[k]);
+        if (owner[a[k]] != inum ||
+            walk_extents(inum, (struct extent *)blk(a[k]), NXEXTENT) < NXEXTENT)
+          break;
+      }
+    }
+  } else {
+    for (i = 0; i < NDIRECT; i++) {
+      if (dip->addrs[i] && files[inum].n < want) {
+        claim(inum, dip->addrs[i]);
+        bladd(&files[inum], dip->addrs[i]);
+      }
+    }
+    for (i = 0; i < 3; i++) {
+      if (dip->addrs[NDIRECT + i] && files[inum].n < want)
+        walk_ind(inum, dip->addrs[NDIRECT + i], i, want);
+    }
+  }
+  if (files[inum].n < want)
+    error("inode %u: size %u but only %u blocks", inum, dip->size,
+          files[inum].n);
+}
+
+// Directories.
+
+static uint *links; // per inode: directory entries naming it
+static char **paths;
+
+// Hash of a name, as dirhash() in kernel/fs/fs.c.
+static uint dirhash(const char *name) {
+  return crc32c(0, name, strnlen(name, DIRSIZ));
+}
+
+// Directory dinum's logical block lbn, or 0 if it has none.
+static char *dirblk(uint dinum, uint lbn) {
+  return lbn < files[dinum].n ? blk(files[dinum].b[lbn]) : 0;
+}
+
+// Check the table and leaves of hashed directory dinum (see
+// fs.h).
+static void check_htdir(uint dinum) {
+  struct dinode *dp = dinode(dinum);
+  uint nblk = dp->size / BSIZE, depth, p, q, lbn, i, *bits;
+  struct htslot *hs;
+  struct dirent *de;
+
+  if (dp->type != T_DIR || dp->size % BSIZE != 0 ||
+      nblk < HTBLOCKS + 2 || nblk > files[dinum].n) {
+    error("directory %u: hashed, but type %u and size %u", dinum, dp->type,
+          dp->size);
+    return;
+  }
+  hs = (struct htslot *)dirblk(dinum, 1);
+  depth = hs[0].v[1];
+  if (hs[0].v[0] != HTMAGIC || depth > HTMAXDEPTH) {
+    error("directory %u: bad table header %x depth %u", dinum, hs[0].v[0],
+          depth);
+    return;
+  }
+  for (lbn = 1; lbn <= HTBLOCKS; lbn++) {
+    hs = (struct htslot *)dirblk(dinum, lbn);
+    for (i = 0; i < DPB; i++) {
+      if (hs[i].inum != 0)
+        error("directory %u: table block %u slot %u in use", dinum, lbn, i);
+    }
+  }
+  de = (struct dirent *)dirblk(dinum, 0);
+  for (i = 2; i < DPB; i++) {
+    if (de[i].inum != 0)
+      error("directory %u: entry %u of block 0 in use", dinum, i, 0);
+  }
+
+  // bits[lbn]: the hash bits of leaf lbn, from the first table
+  // entry pointing at it; -1 if none does.
+  if ((bits = malloc(nblk * sizeof(uint))) == 0)
+    die("out of memory");
+  memset(bits, 0xff, nblk * sizeof(uint));
+  for (p = 0; p < (1u << depth); p++) {
+    q = p + HTPERSLOT;
+    hs = (struct htslot *)dirblk(dinum, 1 + q / (DPB * HTPERSLOT));
+    lbn = hs[q / HTPERSLOT % DPB].v[q % HTPERSLOT];
+    if (lbn <= HTBLOCKS || lbn >= nblk) {
+      error("directory %u: table entry %u points at block %u", dinum, p, lbn);
+      continue;
+    }
+    hs = (struct htslot *)dirblk(dinum, lbn);
+    if (hs[0].inum != 0 || hs[0].v[0] != HTMAGIC || hs[0].v[1] > depth) {
+      error("directory %u: leaf %u has a bad header, depth %u", dinum, lbn,
+            hs[0].v[1]);
+      continue;
+    }
+    if (bits[lbn] == (uint)-1)
+      bits[lbn] = p & ((1u << hs[0].v[1]) - 1);
+    else if (bits[lbn] != (p & ((1u << hs[0].v[1]) - 1)))
+      error("directory %u: table entry %u does not belong to leaf %u", dinum,
+            p, lbn);
+  }
+
+  for (lbn = HTBLOCKS + 1; lbn < nblk; lbn++) {
+    hs = (struct htslot *)dirblk(dinum, lbn);
+    de = (struct dirent *)hs;
+    for (i = 1; i < DPB; i++) {
+      if (de[i].inum == 0)
+        continue;
+      if (bits[lbn] == (uint)-1) {
+        error("directory %u: leaf %u holds names but is not in the table",
+              dinum, lbn, 0);
+        break;
+      }
+      if ((dirhash(de[i].name) & ((1u << hs[0].v[1]) - 1)) != bits[lbn])
+        error("directory %u: leaf %u entry %u hashes to another leaf", dinum,
+              lbn, i);
+    }
+  }
+  free(bits);
+}
+
+static void walk_dirs(void) {
+  uint *queue = calloc(sb.ninodes, sizeof(uint));
+  uint head = 0, tail = 0;
+  char path[1024];
+
+  if (queue == 0)
+    die("out of memory");
+  if (dinode(ROOTINO)->type != T_DIR) {
+    error("root inode %u is not a directory", ROOTINO, 0, 0);
+    return;
+  }
+  paths[ROOTINO] = "/";
+  queue[tail++] = ROOTINO;
+  while (head < tail) {
+    uint dinum = queue[head++];
+    struct dinode *dp = dinode(dinum);
+    if (dp->flags & I_HASHDIR)
+      check_htdir(dinum);
+    for (uint off = 0; off + sizeof(struct dirent) <= dp->size;
+         off += sizeof(struct dirent)) {
+      if (off / BSIZE >= files[dinum].n)
+        break;
+      struct dirent *de = (struct dirent *)(blk(files[dinum].b[off / BSIZE]) +
+                                            off % BSIZE);
+      if (de->inum == 0)
+        continue;
+      if (de->inum >= sb.ninodes || dinode(de->inum)->type == 0) {
+        error("directory %u: entry at %u names free inode %u", dinum, off,
+              de->inum);
+        continue;
+      }
+      if (strncmp(de->name, ".", DIRSIZ) == 0) {
+        if (de->inum != dinum)
+          error("directory %u: \".\" is inode %u", dinum, de->inum, 0);
+        continue;
+      }
+      links[de->inum]++;
+      if (strncmp(de->name, "..", DIRSIZ) == 0 || paths[de->inum])
+        continue;
+      snprintf(path, sizeof(path), "%s%s%.*s", paths[dinum],
+               dinum == ROOTINO ? "" : "/", DIRSIZ, de->name);
+      if ((paths[de->inum] = strdup(path)) == 0)
+        die("out of memory");
+      if (dinode(de->inum)->type == T_DIR)
+        queue[tail++] = de->inum;
+    }
+  }
+  free(queue);
+}
+
+int main(int argc, char *argv[]) {
+  struct stat st;
+  int c, fd, wflag = 0;
+  uint inum, b, nleak = 0, nused = 0;
+  uint nfile = 0, ninline = 0, ndir = 0, nfrag = 0, nruns = 0, ncontig = 0;
+  uint64 nfblk = 0;
+
+  while ((c = getopt(argc, argv, "wv")) != -1) {
+    switch (c) {
+    case 'w':
+      wflag = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      die("usage: fsck [-w] [-v] fs.img");
+    }
+  }
+  if (optind != argc - 1)
+    die("usage: fsck [-w] [-v] fs.img");
+
+  if ((fd = open(argv[optind], wflag ? O_RDWR : O_RDONLY)) < 0 ||
+      fstat(fd, &st) < 0)
+    die(argv[optind]);
+  imgsize = st.st_size;
+  if (imgsize < SBOFFSET + sizeof(sb))
+    die("image too small");
+  img = mmap(0, imgsize, PROT_READ | PROT_WRITE,
+             wflag ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  if (img == MAP_FAILED)
+    die("mmap failed");
+
+  memmove(&sb, img + SBOFFSET, sizeof(sb));
+  if (sb.magic != FSMAGIC)
+    die("not a file system");
+  fsbsize = sb.bsize ? sb.bsize : BSIZEMIN;
+  if (BSIZE < BSIZEMIN || BSIZE > BSIZEMAX || (BSIZE & (BSIZE - 1)) != 0)
+    die("bad block size");
+  if ((uint64)sb.size * BSIZE > imgsize)
+    die("image shorter than its super block says");
+  datastart = sb.size - sb.nblocks;
+  if (sb.nlog < 2 || sb.logstart + sb.nlog > datastart ||
+      IBLOCK(sb.ninodes - 1, sb) >= sb.bmapstart ||
+      sb.bmapstart + (sb.size + BPB - 1) / BPB > datastart)
+    die("bad layout in the super block");
+  printf("%s: %d blocks of %d bytes, %d inodes, %d log blocks\n",
+         argv[optind], sb.size, BSIZE, sb.ninodes, sb.nlog);
+
+  replay();
+
+  files = calloc(sb.ninodes, sizeof(struct blist));
+  owner = calloc(sb.size, sizeof(uint));
+  links = calloc(sb.ninodes, sizeof(uint));
+  paths = calloc(sb.ninodes, sizeof(char *));
+  if (!files || !owner || !links || !paths)
+    die("out of memory");
+  for (inum = 1; inum < sb.ninodes; inum++) {
+    struct dinode *dip = dinode(inum);
+    if (dip->type == 0)
+      continue;
+    if (dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEVICE) {
+      error("inode %u: bad type %u", inum, dip->type, 0);
+      continue;
+    }
+    walk_inode(inum, dip);
+  }
+
+  for (b = 0; b < sb.size; b++) {
+    if (b < datastart) {
+      if (!inuse(b))
+        error("block %u: metadata but free in the bitmap", b, 0, 0);
+    } else if (owner[b]) {
+      nused++;
+    } else if (inuse(b)) {
+      nleak++;
+    }
+  }
+
+  walk_dirs();
+  for (inum = 1; inum < sb.ninodes; inum++) {
+    struct dinode *dip = dinode(inum);
+    if (dip->type == 0)
+      continue;
+    if (paths[inum] == 0)
+      error("inode %u: not in any directory", inum, 0, 0);
+    else if (links[inum] != dip->nlink)
+      error("inode %u: nlink %u but %u links", inum, dip->nlink, links[inum]);
+    if (dip->type == T_DIR)
+      ndir++;
+    else if (dip->type == T_FILE)
+      nfile++;
+    if (dip->flags & I_INLINE)
+      ninline++;
+  }
+
+  // fragmentation, of regular files with data.
+  for (inum = 1; inum < sb.ninodes; inum++) {
+    struct blist *l = &files[inum];
+    uint runs = 0;
+    if (dinode(inum)->type != T_FILE || l->n == 0)
+      continue;
+    for (uint i = 0; i < l->n; i++) {
+      if (i == 0 || l->b[i] != l->b[i - 1] + 1)
+        runs++;
+    }
+    nfrag++;
+    nruns += runs;
+    nfblk += l->n;
+    if (runs == 1)
+      ncontig++;
+    if (verbose)
+      printf("%-32s inode %5d: %7d blocks, %5d extents, average run %.1f\n",
+             paths[inum] ? paths[inum] : "?", inum, l->n, runs,
+             (double)l->n / runs);
+  }
+
+  printf("%d files (%d inline), %d directories; %d of %d data blocks in use",
+         nfile, ninline, ndir, nused, sb.nblocks);
+  if (nleak)
+    printf(", %d more marked in use but not mapped", nleak);
+  printf("\n");
+  if (nfrag)
+    printf("%d files with data: %.2f extents per file, average run %.1f "
+           "blocks, %d%% in one extent\n",
+           nfrag, (double)nruns / nfrag, (double)nfblk / nruns,
+           ncontig * 100 / nfrag);
+  if (wflag && msync(img, imgsize, MS_SYNC) < 0)
+    die("msync failed");
+  printf("%d errors\n", nerr);
+  return nerr ? 1 : 0;
+}
@@ -37,6 +37,7 @@
 #define VIRTIO_MMIO_DEVICE_DESC_LOW                                            \
   0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG 0x100 // device-specific configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
@@ -53,9 +54,15 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX 29
 
+// offset of num_queues (uint16) in struct virtio_blk_config,
+// valid only if VIRTIO_BLK_F_MQ has been negotiated.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// a request takes one descriptor per data block plus two,
+// so this also bounds multi-block requests.
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -3,7 +3,9 @@
 // uses qemu's mmio interface to virtio.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 \
-//          -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+//          -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
+//
+// with VIRTIO_BLK_F_MQ each hart gets its own virtqueue.
 //
 
 #include "../driver/virtio.h"
@@ -23,7 +25,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue and the driver state that goes with it.
+// with VIRTIO_BLK_F_MQ there is one of these per hart, each with
+// its own lock, so harts submitting I/O do not contend.
+struct vqueue {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -58,14 +63,71 @@ static struct disk {
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
 
-  struct spinlock vdisk_lock;
+  struct spinlock lock;
+  int id; // queue index, written to QUEUE_NOTIFY
+};
+
+static struct disk {
+  struct vqueue q[NCPU];
+  int nqueue; // number of queues in use, 1 <= nqueue <= NCPU
 
+  struct spinlock lock; // protects crash_after, for all queues
+  int crash_after;      // blocks still written before a crash, or -1
 } __attribute__((aligned(PGSIZE))) disk;
 
+// set up virtqueue id; the device must have it selected
+// via VIRTIO_MMIO_QUEUE_SEL.
+static void virtq_init(struct vqueue *q, int id) {
+  initlock(&q->lock, "virtio_disk");
+  q->id = id;
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = id;
+
+  // ensure the queue is not in use.
+  if (*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if (max == 0)
+    panic("virtio disk has no queue");
+  if (max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = alloc_page();
+  q->avail = alloc_page();
+  q->used = alloc_page();
+  if (!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for (int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
+
 void virtio_disk_init(void) {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  initlock(&disk.lock, "virtio_crash");
+  disk.crash_after = -1;
 
   if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
       *R(VIRTIO_MMIO_VERSION) != 2 || *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -89,7 +151,6 @@ void virtio_disk_init(void) {
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
@@ -104,47 +165,20 @@ void virtio_disk_init(void) {
   if (!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if (*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if (max == 0)
-    panic("virtio disk has no queue 0");
-  if (max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = alloc_page();
-  disk.avail = alloc_page();
-  disk.used = alloc_page();
-  if (!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // one queue per hart if the device offers that many,
+  // otherwise harts share the queues round-robin.
+  disk.nqueue = 1;
+  if (features & (1 << VIRTIO_BLK_F_MQ)) {
+    disk.nqueue = *(volatile uint16 *)R(VIRTIO_MMIO_CONFIG +
+                                        VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if (disk.nqueue > NCPU)
+      disk.nqueue = NCPU;
+    if (disk.nqueue < 1)
+      disk.nqueue = 1;
+  }
 
-  // all NUM descriptors start out unused.
-  for (int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  for (int i = 0; i < disk.nqueue; i++)
+    virtq_init(&disk.q[i], i);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -154,10 +188,10 @@ void virtio_disk_init(void) {
 }
 
 // find a free descriptor, mark it non-free, return its index.
-static int alloc_desc(void) {
+static int alloc_desc(struct vqueue *q) {
   for (int i = 0; i < NUM; i++) {
-    if (disk.free[i]) {
-      disk.free[i] = 0;
+    if (q->free[i]) {
+      q->free[i] = 0;
       return i;
     }
   }
@@ -165,25 +199,25 @@ static int alloc_desc(void) {
 }
 
 // mark a descriptor as free.
-static void free_desc(int i) {
+static void free_desc(struct vqueue *q, int i) {
   if (i >= NUM)
     panic("free_desc 1");
-  if (disk.free[i])
+  if (q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
-static void free_chain(int i) {
+static void free_chain(struct vqueue *q, int i) {
   while (1) {
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if (flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -191,42 +225,78 @@ static void free_chain(int i) {
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
-static int alloc3_desc(int *idx) {
-  for (int i = 0; i < 3; i++) {
-    idx[i] = alloc_desc();
+// allocate n descriptors (they need not be contiguous).
+static int alloc_descs(struct vqueue *q, int *idx, int n) {
+  for (int i = 0; i < n; i++) {
+    idx[i] = alloc_desc(q);
     if (idx[i] < 0) {
       for (int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void virtio_disk_rw(struct buf *b, int write) {
-  uint64 sector = b->blockno * (BSIZE / 512);
+// the queue the calling hart submits to.
+static struct vqueue *myqueue(void) {
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &disk.q[id % disk.nqueue];
+}
 
-  acquire(&disk.vdisk_lock);
+// For crash tests: after n more blocks have been written, drop
+// every write as if the power had failed, which can cut a
+// multi-block request short anywhere. n < 0 turns it off.
+void virtio_disk_crash(int n) {
+  acquire(&disk.lock);
+  disk.crash_after = n;
+  release(&disk.lock);
+}
+
+// one request moving n buffers to or from the n consecutive
+// blocks starting at blockno. n <= NUM - 2.
+static void virtq_rw(struct vqueue *q, struct buf **bs, int n, uint blockno,
+                     int write) {
+  uint64 sector = (uint64)blockno * (BSIZE / 512);
+
+  if (write) {
+    acquire(&disk.lock);
+    if (disk.crash_after >= 0) {
+      if (n > disk.crash_after)
+        n = disk.crash_after;
+      disk.crash_after -= n;
+    }
+    release(&disk.lock);
+    if (n == 0) {
+      bs[0]->disk = 0;
+      return;
+    }
+  }
+
+  acquire(&q->lock);
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. the data part may be
+  // split over several descriptors, one per buffer.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NUM];
   while (1) {
-    if (alloc3_desc(idx) == 0) {
+    if (alloc_descs(q, idx, n + 2) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&q->free[0], &q->lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[idx[0]];
 
   if (write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -235,82 +305,113 @@ void virtio_disk_rw(struct buf *b, int write) {
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64)buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  q->desc[idx[0]].addr = (uint64)buf0;
+  q->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  q->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  q->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64)b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if (write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for (int i = 1; i <= n; i++) {
+    q->desc[idx[i]].addr = (uint64)bs[i - 1]->data;
+    q->desc[idx[i]].len = BSIZE;
+    if (write)
+      q->desc[idx[i]].flags = 0; // device reads b->data
+    else
+      q->desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    q->desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    q->desc[idx[i]].next = idx[i + 1];
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  q->info[idx[0]].status = 0xff; // device writes 0 on success
+  q->desc[idx[n + 1]].addr = (uint64)&q->info[idx[0]].status;
+  q->desc[idx[n + 1]].len = 1;
+  q->desc[idx[n + 1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  q->desc[idx[n + 1]].next = 0;
 
   // record struct buf for virtio_disk_intr().
+  // the first buffer stands for the whole request.
+  struct buf *b = bs[0];
   b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[idx[0]].b = b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->id; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
   while (b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &q->lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  q->info[idx[0]].b = 0;
+  free_chain(q, idx[0]);
 
-  release(&disk.vdisk_lock);
+  release(&q->lock);
 }
 
-void virtio_disk_intr(void) {
-  acquire(&disk.vdisk_lock);
+void virtio_disk_rw(struct buf *b, int write) {
+  virtq_rw(myqueue(), &b, 1, b->blockno, write);
+}
 
-  // the device won't raise another interrupt until we tell it
-  // we've seen this interrupt, which the following line does.
-  // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
-  // completion entries in this interrupt, and have nothing to do
-  // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+// Read or write n buffers from or to the n consecutive disk blocks
+// starting at blockno, using as few requests as the queue allows.
+// The buffers' own blockno fields are ignored.
+void virtio_disk_rwv(struct buf **bs, int n, uint blockno, int write) {
+  struct vqueue *q = myqueue();
+
+  while (n > 0) {
+    int m = n < NUM - 2 ? n : NUM - 2;
+    virtq_rw(q, bs, m, blockno, write);
+    bs += m;
+    blockno += m;
+    n -= m;
+  }
+}
 
-  __sync_synchronize();
+// retire the completed requests of one queue.
+static void virtq_intr(struct vqueue *q) {
+  acquire(&q->lock);
 
-  // the device increments disk.used->idx when it
+  // the device increments q->used->idx when it
   // adds an entry to the used ring.
 
-  while (disk.used_idx != disk.used->idx) {
+  while (q->used_idx != q->used->idx) {
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = q->used->ring[q->used_idx % NUM].id;
 
-    if (disk.info[id].status != 0)
+    if (q->info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
+    struct buf *b = q->info[id].b;
     b->disk = 0; // disk is done with buf
     wakeup(b);
 
-    disk.used_idx += 1;
+    q->used_idx += 1;
   }
 
-  release(&disk.vdisk_lock);
-}
\ No newline at end of file
+  release(&q->lock);
+}
+
+void virtio_disk_intr(void) {
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" rings, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  // virtio-mmio has a single interrupt line for all queues,
+  // so look at every used ring; each is guarded by its own lock.
+  for (int i = 0; i < disk.nqueue; i++)
+    virtq_intr(&disk.q[i]);
+}
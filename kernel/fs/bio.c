@@ -12,6 +12,31 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Replacement is 2Q (Johnson and Shasha). A block of file data
+// (bread_data()) that is not in the cache goes into a1, a FIFO
+// of about NA1 probation buffers, and is recycled from there
+// first. The block numbers a1 recycles are remembered for a
+// while on the ghost list; a block read again while remembered
+// goes into am, an LRU list of the rest of the cache. So a large
+// scan cycles through a1 and leaves am alone. Metadata (inode,
+// bitmap, directory, indirect and extent blocks: whatever comes
+// from bread()) goes straight into am. bpolicy(BP_LRU) puts
+// everything in am, which makes the cache plain LRU.
+//
+// Block size: a buffer's data is BSIZE bytes from the page
+// allocator, several buffers to a page for blocks smaller than a
+// page. binit() sizes them for BSIZEMIN, which is enough to read
+// the super block; fsinit() then calls bresize() with the block
+// size the super block gives, before it reads anything else.
+//
+// Write-back: file system blocks reach the disk through the log
+// (log.c). Once a transaction is committed its blocks are dirty
+// (bdirty()): durable in the log, but not yet at their home
+// locations. A dirty buffer stays pinned until bflush() writes it
+// home, either from the flusher thread (fs.c) once it has been
+// dirty for a while, or from a checkpoint, which must write all
+// of them before it frees the log.
 
 #include "../fs/buf.h"
 #include "../fs/fs.h"
@@ -22,6 +47,15 @@
 #include "../sync/sleeplock.h"
 #include "../sync/spinlock.h"
 
+// blocks handed to the disk in one write-back request.
+#define BIOBLOCKS 16
+// a1 gives up its oldest buffer first once it holds more than
+// this many; the ghost list remembers this many block #s.
+#define NA1 (NBUF / 4)
+#define NGHOST (NBUF * 2)
+
+extern uint ticks;
+
 struct {
   struct spinlock lock;
   struct buf buf[NBUF]; // 缓冲区数组 固定大小
@@ -29,17 +63,64 @@ struct {
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
-  struct buf head; // 双向链表的哨兵节点
+  struct buf head; // 双向链表的哨兵节点 (am)
+
+  struct buf a1; // a1, through prev/next; a1.next is newest
+  int na1;
+  struct {
+    uint dev;
+    uint blockno;
+  } ghost[NGHOST]; // recycled from a1; dev 0 is a free slot
+  int nextghost;
+  int policy;
+  uint64 hit[NBPOLICY];
+  uint64 miss[NBPOLICY];
+
+  int ndirty;
+  struct sleeplock wblock;     // one write-back at a time
+  uint wbblk[NBUF];            // block #s it is writing
+  struct buf wbbuf[BIOBLOCKS]; // copies of a run of them
+  uint64 nwb;
+  uint64 nwbreq;
+  uint bsize; // bytes of data in each buffer
 } bcache;
 
+// Give the n buffers at bs size bytes of data each, in place of
+// the bcache.bsize bytes they have.
+static void bdata(struct buf *bs, int n, uint size) {
+  int per = size < PAGESIZE ? PAGESIZE / size : 1;
+  int npg = size < PAGESIZE ? 1 : size / PAGESIZE;
+  int opg = bcache.bsize < PAGESIZE ? 1 : bcache.bsize / PAGESIZE;
+  uchar *mem = 0;
+
+  for (int i = 0; i < n; i++) {
+    // the buffer at the start of a page frees it.
+    if (bs[i].data != 0 && (uint64)bs[i].data % PAGESIZE == 0) {
+      for (int j = 0; j < opg; j++)
+        free_page(bs[i].data + j * PAGESIZE);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (i % per == 0 && (mem = alloc_pages(npg)) == 0)
+      panic("bdata: out of memory");
+    bs[i].data = mem + (i % per) * size;
+  }
+}
+
 void binit(void) {
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  initsleeplock(&bcache.wblock, "writeback");
+  for (b = bcache.wbbuf; b < bcache.wbbuf + BIOBLOCKS; b++)
+    initsleeplock(&b->lock, "wbbuf");
 
   // 创建循环双向链表
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
+  bcache.a1.prev = &bcache.a1;
+  bcache.a1.next = &bcache.a1;
+  bcache.policy = BP_2Q;
 
   // 将所有缓冲区插入到链表头部
   for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
@@ -49,53 +130,174 @@ void binit(void) {
     bcache.head.next->prev = b;
     bcache.head.next = b;
   }
+  bdata(bcache.buf, NBUF, BSIZEMIN);
+  bdata(bcache.wbbuf, BIOBLOCKS, BSIZEMIN);
+  bcache.bsize = BSIZEMIN;
+}
+
+// Change the size of every buffer's data to size bytes, for a
+// file system with that block size. Whatever the cache holds is
+// forgotten, so nothing may be using or waiting to write a
+// buffer.
+void bresize(uint size) {
+  struct buf *b;
+
+  if (size == bcache.bsize)
+    return;
+  acquire(&bcache.lock);
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    if (b->refcnt != 0 || b->dirty)
+      panic("bresize: busy");
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+  }
+  for (int i = 0; i < NGHOST; i++)
+    bcache.ghost[i].dev = 0;
+  release(&bcache.lock);
+  bdata(bcache.buf, NBUF, size);
+  bdata(bcache.wbbuf, BIOBLOCKS, size);
+  bcache.bsize = size;
+}
+
+static void bunlink(struct buf *b) {
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Put b at the front of list h.
+static void bpush(struct buf *h, struct buf *b) {
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+}
+
+// Move b from a1 to the front of am.
+static void bpromote(struct buf *b) {
+  bunlink(b);
+  b->a1 = 0;
+  bcache.na1--;
+  bpush(&bcache.head, b);
+}
+
+// Is block blockno of dev on the ghost list? Takes it off.
+static int bghost(uint dev, uint blockno) {
+  for (int i = 0; i < NGHOST; i++) {
+    if (bcache.ghost[i].blockno == blockno && bcache.ghost[i].dev == dev) {
+      bcache.ghost[i].dev = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The buffer to recycle: the oldest unreferenced one in a1 if
+// a1 holds more than NA1, else the least recently used one in
+// am, else any in a1. Caller holds bcache.lock.
+static struct buf *bvictim(void) {
+  struct buf *b;
+
+  if (bcache.na1 > NA1) {
+    for (b = bcache.a1.prev; b != &bcache.a1; b = b->prev) {
+      if (b->refcnt == 0)
+        return b;
+    }
+  }
+  // 从链表尾部回收最久未使用且未被引用的缓冲区
+  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+    if (b->refcnt == 0)
+      return b;
+  }
+  for (b = bcache.a1.prev; b != &bcache.a1; b = b->prev) {
+    if (b->refcnt == 0)
+      return b;
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
+// If not found, allocate a buffer, in a1 if data says it is
+// file data, else in am.
 // In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
+static struct buf *bget(uint dev, uint blockno, int data) {
   struct buf *b;
 
   acquire(&bcache.lock);
 
-  // 检查缓存中是否已有该块 遍历链表
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+  // 检查缓存中是否已有该块
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
     if (b->dev == dev && b->blockno == blockno) { // 缓存命中
-      b->refcnt++;                                // 增加引用计数
-      release(&bcache.lock);                      // 释放全局锁
-      acquiresleep(&b->lock);                     // 获取缓冲区锁
+      bcache.hit[bcache.policy]++;
+      if (b->a1 && !data) // now metadata
+        bpromote(b);
+      b->refcnt++;            // 增加引用计数
+      release(&bcache.lock);  // 释放全局锁
+      acquiresleep(&b->lock); // 获取缓冲区锁
       return b;
     }
   }
 
-  // 缓存未命中 使用 LRU 策略分配新缓冲区
-  // 从链表尾部回收最久未使用且未被引用的缓冲区
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0) { // 空闲缓冲区
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->disk = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // 缓存未命中 回收一个未被引用的缓冲区
+  bcache.miss[bcache.policy]++;
+  if ((b = bvictim()) == 0)
+    panic("bget: no buffers");
+  bunlink(b);
+  if (b->a1) {
+    bcache.na1--;
+    if (b->valid) { // remember it
+      bcache.ghost[bcache.nextghost].dev = b->dev;
+      bcache.ghost[bcache.nextghost].blockno = b->blockno;
+      bcache.nextghost = (bcache.nextghost + 1) % NGHOST;
     }
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->disk = 0;
+  b->refcnt = 1;
+  b->a1 = bcache.policy == BP_2Q && data && !bghost(dev, blockno);
+  if (b->a1) {
+    bcache.na1++;
+    bpush(&bcache.a1, b);
+  } else {
+    bpush(&bcache.head, b);
+  }
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Read b's block from disk if it does not hold it yet.
+static struct buf *bfill(struct buf *b) {
+  if (!b->valid) {        // 数据无效 需要从磁盘读取
+    virtio_disk_rw(b, 0); // 从磁盘读取数据 b->disk = 0
+    b->valid = 1;         // 标记数据为有效
+  }
+  return b;
 }
 
 // 读取块数据
 // Return a locked buf with the contents of the indicated block.
 struct buf *bread(uint dev, uint blockno) {
+  return bfill(bget(dev, blockno, 0));
+}
+
+// bread() for a block of file data, which the cache keeps on
+// probation until it is read again.
+struct buf *bread_data(uint dev, uint blockno) {
+  return bfill(bget(dev, blockno, 1));
+}
+
+// Return a locked buf for the indicated block without reading
+// it from disk, for a caller that is about to overwrite all of
+// it. A block that is already cached keeps its contents.
+// data is as for bget().
+struct buf *bnew(uint dev, uint blockno, int data) {
   struct buf *b;
 
-  b = bget(dev, blockno); // 获取缓冲区
-  if (!b->valid) {        // 数据无效 需要从磁盘读取
-    virtio_disk_rw(b, 0); // 从磁盘读取数据 b->disk = 0
-    b->valid = 1;         // 标记数据为有效
-  }
+  b = bget(dev, blockno, data);
+  b->valid = 1;
   return b;
 }
 
@@ -109,6 +311,32 @@ void bwrite(struct buf *b) {
   virtio_disk_rw(b, 1); // 写入磁盘
 }
 
+// Write the contents of n locked buffers to the n consecutive
+// disk blocks starting at blockno, in as few disk requests as
+// the driver allows. The log uses this to copy cached blocks
+// into the on-disk log without going through log-block buffers,
+// and to install runs of neighbouring blocks.
+void bwritev(struct buf **bs, int n, uint blockno) {
+  for (int i = 0; i < n; i++) {
+    if (!holdingsleep(&bs[i]->lock))
+      panic("bwritev");
+  }
+  virtio_disk_rwv(bs, n, blockno, 1);
+}
+
+// Read the n consecutive disk blocks starting at blockno into
+// n locked buffers, whatever blocks they cache. Log recovery
+// uses this to read log blocks straight into home buffers.
+void breadv(struct buf **bs, int n, uint blockno) {
+  for (int i = 0; i < n; i++) {
+    if (!holdingsleep(&bs[i]->lock))
+      panic("breadv");
+  }
+  virtio_disk_rwv(bs, n, blockno, 0);
+  for (int i = 0; i < n; i++)
+    bs[i]->valid = 1;
+}
+
 // 释放缓冲区
 // Move to the head of the most-recently-used list.
 void brelse(struct buf *b) {
@@ -119,14 +347,10 @@ void brelse(struct buf *b) {
 
   acquire(&bcache.lock);
   b->refcnt--;
-  if (b->refcnt == 0) { // 没有其他进程使用
+  if (b->refcnt == 0 && !b->a1) { // 没有其他进程使用; a1 is a FIFO
     // 将缓冲区移到链表头部（标记为最近使用）
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bunlink(b);
+    bpush(&bcache.head, b);
   }
 
   release(&bcache.lock);
@@ -146,31 +370,169 @@ void bunpin(struct buf *b) {
   release(&bcache.lock);
 }
 
-// 将设备上所有脏缓冲区写回磁盘
-void flush_all_blocks(uint dev) {
-  struct buf *b;
+// Commit has written locked b, which log_write() pinned, to the
+// log. Mark it dirty; it keeps one pin until it is written home.
+void bdirty(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("bdirty");
 
+  b->logged = 0;
   acquire(&bcache.lock);
+  if (b->dirty) {
+    b->refcnt--; // pinned already
+  } else {
+    b->dirty = 1;
+    b->dticks = ticks;
+    bcache.ndirty++;
+  }
+  release(&bcache.lock);
+}
 
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-    // 只处理属于指定设备且有效的缓冲区
-    if (b->dev == dev && b->valid) {
-      b->refcnt++; // 增加引用计数，防止被回收
-      release(&bcache.lock);
+// The number of dirty buffers.
+int bndirty(void) { return bcache.ndirty; }
 
-      acquiresleep(&b->lock);
+// Write dev's dirty blocks home: those dirty for at least age
+// ticks and, if blocks is not 0, among the n listed there. A
+// block the open transaction has changed is left for later.
+// The blocks go out in block order, runs of neighbours in one
+// disk request, from copies in bcache.wbbuf: holding the locks
+// of a whole run could deadlock with a file system call that
+// holds one of them and waits for another. A buffer stays
+// pinned until its copy is on disk, so no one reads the block
+// from disk before then. Adds the disk requests to *nreq and
+// returns the number of blocks written.
+static int writeback(uint dev, uint age, uint *blocks, int n, int *nreq) {
+  struct buf *b, *bs[BIOBLOCKS], *ws[BIOBLOCKS];
+  int i, j, m, nblk = 0, tot = 0;
+  uint t;
 
-      virtio_disk_rw(b, 1); // 写入磁盘
+  if (bcache.ndirty == 0)
+    return 0;
+  acquiresleep(&bcache.wblock);
+  acquire(&bcache.lock);
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    if (!b->dirty || b->dev != dev || ticks - b->dticks < age)
+      continue;
+    for (j = 0; blocks && j < n && blocks[j] != b->blockno; j++)
+      ;
+    if (blocks == 0 || j < n)
+      bcache.wbblk[nblk++] = b->blockno;
+  }
+  release(&bcache.lock);
 
-      releasesleep(&b->lock);
+  for (i = 1; i < nblk; i++) { // insertion sort by block #
+    t = bcache.wbblk[i];
+    for (j = i; j > 0 && bcache.wbblk[j - 1] > t; j--)
+      bcache.wbblk[j] = bcache.wbblk[j - 1];
+    bcache.wbblk[j] = t;
+  }
 
+  for (m = 0; m < BIOBLOCKS; m++) {
+    ws[m] = &bcache.wbbuf[m];
+    acquiresleep(&ws[m]->lock);
+  }
+  for (i = 0; i < nblk;) {
+    // copy a run; only write-back cleans a buffer, so these are
+    // all still dirty, and cached.
+    for (m = 0; i < nblk && m < BIOBLOCKS; i++) {
+      if (m > 0 && bcache.wbblk[i] != bs[0]->blockno + m)
+        break;
+      b = bread(dev, bcache.wbblk[i]);
+      if (b->logged) {
+        brelse(b);
+        i++;
+        break;
+      }
+      memmove(ws[m]->data, b->data, BSIZE);
       acquire(&bcache.lock);
-      b->refcnt--;
+      b->dirty = 0;
+      bcache.ndirty--;
+      release(&bcache.lock);
+      brelse(b); // the dirty pin stays
+      bs[m++] = b;
+    }
+    if (m == 0)
+      continue;
+    bwritev(ws, m, bs[0]->blockno);
+    for (j = 0; j < m; j++)
+      bunpin(bs[j]);
+    tot += m;
+    (*nreq)++;
+    bcache.nwb += m;
+    bcache.nwbreq++;
+  }
+  for (m = 0; m < BIOBLOCKS; m++)
+    releasesleep(&ws[m]->lock);
+  releasesleep(&bcache.wblock);
+  return tot;
+}
 
-      if (b->refcnt == 0) {
-        wakeup(b); // 唤醒等待该缓冲区的进程
-      }
+// Write home dev's blocks that have been dirty for at least age
+// ticks. Returns the number of blocks written.
+int bflush(uint dev, uint age) {
+  int nreq = 0;
+
+  return writeback(dev, age, 0, 0, &nreq);
+}
+
+// Write home those of the n blocks in blocks[] that are dirty,
+// for fsync(). Returns the number of blocks written.
+int bsync(uint dev, uint *blocks, int n) {
+  int nreq = 0;
+
+  return writeback(dev, 0, blocks, n, &nreq);
+}
+
+// 将设备上所有脏缓冲区写回磁盘
+// Returns the number of disk requests that took.
+int flush_all_blocks(uint dev) {
+  int nreq = 0;
+
+  writeback(dev, 0, 0, 0, &nreq);
+  return nreq;
+}
+
+// Copy the buffer cache counters into *st.
+void bstat(struct bstat *st) {
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  st->nvalid = 0;
+  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    if (b->valid)
+      st->nvalid++;
+  }
+  st->ndirty = bcache.ndirty;
+  st->nwb = bcache.nwb;
+  st->nwbreq = bcache.nwbreq;
+  st->policy = bcache.policy;
+  for (int i = 0; i < NBPOLICY; i++) {
+    st->hit[i] = bcache.hit[i];
+    st->miss[i] = bcache.miss[i];
+  }
+  release(&bcache.lock);
+}
+
+// Switch to replacement policy p (BP_LRU or BP_2Q), and return
+// the old one. a1's buffers join am as its least recently used.
+int bpolicy(int p) {
+  struct buf *b;
+  int old;
+
+  acquire(&bcache.lock);
+  old = bcache.policy;
+  if (p == BP_LRU) {
+    while ((b = bcache.a1.prev) != &bcache.a1) {
+      bunlink(b);
+      b->a1 = 0;
+      b->next = &bcache.head;
+      b->prev = bcache.head.prev;
+      bcache.head.prev->next = b;
+      bcache.head.prev = b;
     }
+    bcache.na1 = 0;
   }
+  bcache.policy = p;
   release(&bcache.lock);
-}
\ No newline at end of file
+  return old;
+}
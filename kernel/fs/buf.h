@@ -13,9 +13,29 @@ struct buf {
   uint blockno;          // 块号
   struct sleeplock lock; // 睡眠锁
   uint refcnt;           // 引用计数
+  uint dirty;            // committed, not yet written home (bflush())
+  uint dticks;           // ticks when it became dirty
+  uint logged;           // changed by the open transaction (log_write())
+  uint a1;               // on 2Q's probation list, not the LRU list
   struct buf *prev;      // LRU 链表 指向最久未使用的
   struct buf *next;      // LRU 链表 指向最近使用的
-  uchar data[BSIZE];     // 块数据
+  uchar *data;           // 块数据, BSIZE bytes from the page allocator
+};
+
+// Buffer cache replacement policies (bpolicy()).
+#define BP_LRU 0
+#define BP_2Q 1
+#define NBPOLICY 2
+
+// Buffer cache counters, for bstat() and the bstat system call.
+struct bstat {
+  int nvalid;             // buffers holding a block
+  int ndirty;             // of them, dirty
+  uint64 nwb;             // blocks written home by write-back
+  uint64 nwbreq;          // disk requests that took
+  int policy;             // replacement policy in use
+  uint64 hit[NBPOLICY];   // lookups found in the cache, by policy
+  uint64 miss[NBPOLICY];  // and not
 };
 
 #endif // BUF_H
\ No newline at end of file
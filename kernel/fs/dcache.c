@@ -0,0 +1,159 @@
+// Directory name cache.
+//
+// Remembers what dirlookup() found for a (directory, name) pair:
+// the inode number and the offset of its dirent, or, for a
+// negative entry, that the name is not there. namex() then walks
+// a path it has walked before without reading any directory.
+//
+// dirlookup() fills the cache. Whatever changes a directory
+// keeps it right: dirlink() enters the new name, unlink
+// replaces its name with a negative entry, and iput() purges a
+// directory's entries when it frees the directory, since its
+// inode number may be reused. Callers hold the directory's
+// inode lock, so a lookup cannot race with a change to the
+// same directory.
+
+#include "../fs/fs.h"
+#include "../include/defs.h"
+#include "../include/param.h"
+#include "../include/types.h"
+#include "../sync/spinlock.h"
+
+#define NDHASH (NDCACHE / 2)
+
+struct dentry {
+  uint dev;
+  uint dinum; // directory
+  char name[DIRSIZ];
+  uint inum; // 0: name is not in the directory
+  uint off;  // byte offset of its dirent
+  struct dentry *hnext; // hash chain; 0-terminated
+  struct dentry *prev;  // LRU list, most recently used first
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *hash[NDHASH];
+  struct dentry head; // of the LRU list
+} dcache;
+
+static uint dhash(uint dev, uint dinum, char *name) {
+  uint h = dinum * 31 + dev;
+
+  for (int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+static void dunlink(struct dentry *d) {
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+}
+
+// Move d to the front of the LRU list.
+static void dtouch(struct dentry *d) {
+  dunlink(d);
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+static void dunhash(struct dentry *d) {
+  struct dentry **pp;
+
+  for (pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp;
+       pp = &(*pp)->hnext) {
+    if (*pp == d) {
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->dinum = 0;
+}
+
+// Caller holds dcache.lock.
+static struct dentry *dfind(uint dev, uint dinum, char *name) {
+  struct dentry *d;
+
+  for (d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->hnext) {
+    if (d->dev == dev && d->dinum == dinum &&
+        strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  }
+  return 0;
+}
+
+void dcacheinit(void) {
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.next = dcache.head.prev = &dcache.head;
+  for (d = dcache.ent; d < &dcache.ent[NDCACHE]; d++) {
+    d->dinum = 0;
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+// Look name up in directory dinum. Returns 1 and sets *inum
+// (0 if the name is known to be absent) and *off if the cache
+// knows; returns 0 if it does not.
+int dcache_lookup(uint dev, uint dinum, char *name, uint *inum, uint *off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dev, dinum, name)) == 0) {
+    release(&dcache.lock);
+    return 0;
+  }
+  dtouch(d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dinum is inode inum, with its
+// dirent at off; inum 0 records that name is not there.
+void dcache_enter(uint dev, uint dinum, char *name, uint inum, uint off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dev, dinum, name)) == 0) {
+    d = dcache.head.prev; // least recently used
+    if (d->dinum != 0)
+      dunhash(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[dhash(dev, dinum, name)];
+    dcache.hash[dhash(dev, dinum, name)] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Forget every name in directory dinum.
+void dcache_purge(uint dev, uint dinum) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for (d = dcache.ent; d < &dcache.ent[NDCACHE]; d++) {
+    if (d->dinum == dinum && d->dev == dev) {
+      dunhash(d);
+      dunlink(d); // to the end of the LRU list, to be reused first
+      d->next = &dcache.head;
+      d->prev = dcache.head.prev;
+      dcache.head.prev->next = d;
+      dcache.head.prev = d;
+    }
+  }
+  release(&dcache.lock);
+}
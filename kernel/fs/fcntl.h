@@ -9,4 +9,14 @@
 #define O_CREATE 0x200 // Create if nonexistent
 #define O_TRUNC 0x400  // Truncate to zero length
 
+// mmap() protection and flags
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x01    // writes go back to the file
+#define MAP_PRIVATE 0x02   // writes stay in the process
+#define MAP_ANONYMOUS 0x20 // zeroed memory, no file
+
 #endif // FCNTL_Hc
\ No newline at end of file
@@ -13,6 +13,8 @@
 #include "../sync/sleeplock.h"
 #include "../sync/spinlock.h"
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -66,7 +68,7 @@ void fileclose(struct file *f) {
   if (ff.type == FD_PIPE) {
     pipeclose(ff.pipe, ff.writable);
   } else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
-    begin_op();
+    begin_op(MAXOPBLOCKS);
     iput(ff.ip);
     end_op();
   }
@@ -92,72 +94,257 @@ int filestat(struct file *f, uint64 addr) {
 // Read from file f.
 // addr is a user virtual address.
 int fileread(struct file *f, uint64 addr, int n) {
-  int r = 0;
+  struct iovec iov = {addr, n};
+
+  if (n < 0)
+    return -1;
+  return filereadv(f, &iov, 1, 0);
+}
+
+// Write to file f.
+// addr is a user virtual address.
+int filewrite(struct file *f, uint64 addr, int n) {
+  struct iovec iov = {addr, n};
 
-  if (f->readable == 0)
+  if (n < 0)
     return -1;
+  return filewritev(f, &iov, 1, 0);
+}
 
-  if (f->type == FD_PIPE) {
-    r = piperead(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+// mmapprefault() the user segments iov, before a copy into or
+// out of them that must not fault in a file page: one under
+// ilock(), which mmapfault() may need for the same inode, or
+// under a device's spinlock.
+static int iovprefault(struct iovec *iov, int niov, int write) {
+  for (int i = 0; i < niov; i++) {
+    if (mmapprefault(myproc(), iov[i].base, iov[i].len, write) < 0)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
-  } else if (f->type == FD_INODE) {
+  }
+  return 0;
+}
+
+// Read from file f into the niov segments iov, user virtual
+// addresses, in order. An inode is read at *offp if offp is
+// not 0 (pread()), else at f->off, which moves past the bytes
+// read; all segments are filled under one ilock(). A pipe or
+// device fills only the first segment that gets any bytes,
+// rather than wait for more. Returns the bytes read, or -1.
+int filereadv(struct file *f, struct iovec *iov, int niov, uint *offp) {
+  int i, r = 0, tot = 0;
+
+  if (f->readable == 0 || (offp && f->type != FD_INODE))
+    return -1;
+  if (f->type != FD_PIPE && iovprefault(iov, niov, 1) < 0)
+    return -1;
+
+  if (f->type == FD_INODE) {
+    if (offp == 0)
+      offp = &f->off;
     ilock(f->ip);
-    if ((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
+    for (i = 0; i < niov; i++) {
+      if ((r = pcache_read(f->ip, 1, iov[i].base, *offp, iov[i].len)) < 0)
+        break;
+      *offp += r;
+      tot += r;
+      if (r < iov[i].len)
+        break;
+    }
     iunlock(f->ip);
-  } else {
-    panic("fileread");
+    return r < 0 && tot == 0 ? -1 : tot;
   }
 
+  for (i = 0; i < niov && r == 0; i++) {
+    if (iov[i].len == 0)
+      continue;
+    if (f->type == FD_PIPE) {
+      r = piperead(f->pipe, 1, iov[i].base, iov[i].len);
+    } else if (f->type == FD_DEVICE) {
+      if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+        return -1;
+      r = devsw[f->major].read(1, iov[i].base, iov[i].len);
+    } else {
+      panic("fileread");
+    }
+  }
   return r;
 }
 
-// Write to file f.
-// addr is a user virtual address.
-int filewrite(struct file *f, uint64 addr, int n) {
-  int r, ret = 0;
+// filewritev() for an inode; the segments are user virtual
+// addresses if user_src, else kernel addresses.
+static int inodewritev(struct inode *ip, int user_src, struct iovec *iov,
+                       int niov, uint *offp) {
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // each chunk reserves only what it may need.
+  int max = ((log_maxop() - 1 - 1 - 2) / 2) * BSIZE;
+  int i = 0, j, r, m, n, tot = 0;
+  uint64 done = 0; // bytes of iov[i] written
 
-  if (f->writable == 0)
-    return -1;
+  for (;;) {
+    while (i < niov && done == iov[i].len) {
+      i++;
+      done = 0;
+    }
+    if (i == niov)
+      return tot;
 
-  if (f->type == FD_PIPE) {
-    ret = pipewrite(f->pipe, addr, n);
-  } else if (f->type == FD_DEVICE) {
-    if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
-      return -1;
-    ret = devsw[f->major].write(1, addr, n);
-  } else if (f->type == FD_INODE) {
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
-    int i = 0;
-    while (i < n) {
-      int n1 = n - i;
-      if (n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if (r != n1) {
-        // error from writei
-        break;
+    // past the file's blocks, a write goes to the page cache,
+    // with no transaction, and gets blocks when iflush()
+    // writes it out; so does the rest of the vector, under
+    // the same ilock(). A writer that finds too many writes
+    // waiting writes its own out first. dsize without
+    // ip->lock is only a hint.
+    if (pcache_busy())
+      iflush(ip);
+    if (ip->type == T_FILE && *offp >= ip->dsize) {
+      r = 0;
+      ilock(ip);
+      while (i < niov && ip->type == T_FILE && *offp >= ip->dsize) {
+        n = iov[i].len - done;
+        m = pcache_delay(ip, user_src, iov[i].base + done, *offp, n);
+        *offp += m;
+        done += m;
+        r += m;
+        if (m < n)
+          break;
+        i++;
+        done = 0;
       }
-      i += r;
+      iunlock(ip);
+      tot += r;
+      if (r > 0)
+        continue;
     }
-    ret = (i == n ? n : -1);
-  } else {
-    panic("filewrite");
+
+    // through the log: up to max bytes, from as many segments
+    // as that takes, in one transaction.
+    m = min(iov[i].len - done, max);
+    for (j = i + 1; j < niov && m < max; j++)
+      m += min(iov[j].len, max - m);
+    begin_op((m / BSIZE) * 2 + 1 + 1 + 2);
+    ilock(ip);
+    for (r = 0; r < m; r += n) {
+      n = min(iov[i].len - done, m - r);
+      if (n > 0 && writei(ip, user_src, iov[i].base + done, *offp, n) != n)
+        break; // error from writei
+      *offp += n;
+      done += n;
+      if (done == iov[i].len) {
+        i++;
+        done = 0;
+      }
+    }
+    iunlock(ip);
+    end_op();
+    if (r != m)
+      return -1;
+    tot += r;
   }
+}
+
+// Write the niov segments iov, user virtual addresses, to file
+// f, in order. An inode is written at *offp if offp is not 0
+// (pwrite()), else at f->off, which moves past the bytes
+// written; as much of the vector as fits in a transaction goes
+// in one, under one ilock(). Returns the bytes written, or -1
+// if it could not write them all.
+int filewritev(struct file *f, struct iovec *iov, int niov, uint *offp) {
+  int i, r, tot = 0;
 
-  return ret;
+  if (f->writable == 0 || (offp && f->type != FD_INODE))
+    return -1;
+  if (f->type != FD_PIPE && iovprefault(iov, niov, 0) < 0)
+    return -1;
+
+  if (f->type == FD_INODE)
+    return inodewritev(f->ip, 1, iov, niov, offp ? offp : &f->off);
+
+  for (i = 0; i < niov; i++) {
+    if (f->type == FD_PIPE) {
+      r = pipewrite(f->pipe, 1, iov[i].base, iov[i].len);
+    } else if (f->type == FD_DEVICE) {
+      if (f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+        return -1;
+      r = devsw[f->major].write(1, iov[i].base, iov[i].len);
+    } else {
+      panic("filewrite");
+    }
+    if (r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if (r < iov[i].len)
+      break;
+  }
+  return tot;
+}
+
+// sendfile(): copy up to n bytes of in, an inode, to out, with
+// no trip through user memory. Each page of in comes from the
+// page cache, with a reference (see pcache_page()) so that it
+// needs no ilock() while it goes straight into out's pipe,
+// device or inode, at out->off. in is read at *offp if offp is
+// not 0, else at in->off, which moves past the bytes copied.
+// Returns the bytes copied, fewer at the end of in, or -1.
+int filesend(struct file *out, struct file *in, uint *offp, int n) {
+  struct inode *ip = in->ip;
+  struct iovec iov;
+  uint off;
+  char *pg;
+  int m, r, tot = 0;
+
+  if (in->readable == 0 || in->type != FD_INODE || ip->type != T_FILE ||
+      out->writable == 0 || n < 0)
+    return -1;
+  if (offp == 0)
+    offp = &in->off;
+
+  while (tot < n) {
+    ilock(ip);
+    off = *offp;
+    m = off < ip->size ? min(n - tot, ip->size - off) : 0;
+    m = min(m, PAGESIZE - off % PAGESIZE);
+    pg = m > 0 ? pcache_page(ip, off / PAGESIZE) : 0;
+    iunlock(ip);
+    if (m == 0)
+      break;
+    if (pg == 0)
+      return tot > 0 ? tot : -1;
+
+    iov.base = (uint64)pg + off % PAGESIZE;
+    iov.len = m;
+    if (out->type == FD_PIPE) {
+      r = pipewrite(out->pipe, 0, iov.base, m);
+    } else if (out->type == FD_DEVICE) {
+      if (out->major < 0 || out->major >= NDEV || !devsw[out->major].write)
+        r = -1;
+      else
+        r = devsw[out->major].write(0, iov.base, m);
+    } else if (out->type == FD_INODE) {
+      r = inodewritev(out->ip, 0, &iov, 1, &out->off);
+    } else {
+      panic("filesend");
+    }
+    free_page(pg);
+    if (r < 0)
+      return tot > 0 ? tot : -1;
+    *offp += r;
+    tot += r;
+    if (r < m)
+      break;
+  }
+  return tot;
+}
+
+// fsync(): make f's delayed writes durable, and write its
+// committed blocks home. Other files' blocks are left alone.
+int filesync(struct file *f) {
+  if (f->type != FD_INODE)
+    return -1;
+  iflush(f->ip);
+  ilock(f->ip);
+  isync(f->ip);
+  iunlock(f->ip);
+  return 0;
 }
\ No newline at end of file
@@ -6,11 +6,8 @@
 #ifndef FILE_H
 #define FILE_H
 
-// File types for struct file
-enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE };
-
 struct file {
-  enum { FD_NONE_F, FD_PIPE_F, FD_INODE_F, FD_DEVICE_F } type;
+  enum { FD_NONE, FD_PIPE, FD_INODE, FD_DEVICE } type; // 文件类型
   int ref;           // 引用计数
   char readable;     // 可读标志
   char writable;     // 可写标志
@@ -20,11 +17,26 @@ struct file {
   short major;       // 设备主设备号
 };
 
+// A segment of a user buffer, for readv() and writev().
+struct iovec {
+  uint64 base; // 用户地址
+  uint64 len;  // 字节数
+};
+
 // Extract major and minor device numbers from device ID
 #define major(dev) ((dev) >> 16 & 0xFFFF)
 #define minor(dev) ((dev) & 0xFFFF)
 #define mkdev(m, n) ((uint)((m) << 16 | (n)))
 
+#define NBMAPRUN 4 // cached block mappings per inode
+
+// A cached block mapping: logical blocks [base, base + e.len)
+// of a file are disk blocks [e.start, e.start + e.len).
+struct bmaprun {
+  uint base;
+  struct extent e;
+};
+
 // In-memory copy of an inode
 struct inode {
   uint dev;              // 设备号
@@ -32,6 +44,9 @@ struct inode {
   int ref;               // 引用计数
   struct sleeplock lock; // 睡眠锁
   int valid;             // inode 是否已从磁盘读取
+  struct inode *hnext;   // hash chain, protected by itable.lock
+  struct inode *lprev;   // LRU list of unreferenced inodes,
+  struct inode *lnext;   // also protected by itable.lock
 
   // Copy of disk inode 磁盘 Inode 副本
   short type;
@@ -39,9 +54,51 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT + 1];
+  uint flags;
+  union {
+    uint addrs[NDIRECT + 3];
+    struct iextents ext;
+  };
+
+  // block mappings bmap() resolved recently, so sequential
+  // access does not read an indirect or extent block per block.
+  struct bmaprun runs[NBMAPRUN];
+  int nextrun; // entry to replace next
+
+  // block allocation: bmap() puts a new block at goal, just
+  // after the last one this inode got. writei() sets pawant to
+  // the number of blocks it is adding, and bmap() allocates
+  // them as runs of up to that many, keeping the rest of the
+  // current run in pa.
+  uint goal;
+  uint pawant;
+  struct extent pa;
+
+  // delayed allocation: bytes from dsize up to size were written
+  // to the page cache only (pcache_delay()), and have no blocks
+  // yet; the disk has size dsize. dticks is when the oldest of
+  // them was written. While dsize < size, the page cache holds
+  // a reference to the inode, which iflush() drops.
+  uint dsize;
+  uint dticks;
 };
 
+// Counters kept by fs.c, for benchmarks and tests.
+struct fsstat {
+  uint64 nmapread; // indirect and extent blocks read by bmap()
+  uint64 nmaphit;  // bmap() calls answered from ip->runs[]
+  uint64 nballoc;  // blocks allocated
+  uint64 nbscan;   // bitmap blocks read to allocate them
+  uint64 niread;   // dinodes read by ilock()
+  uint64 ndirent;  // dirents read by dirlookup()
+  uint64 ndchit;   // dirlookup() calls answered by the dcache
+  uint64 npfill;   // pages read into the page cache
+  uint64 npmap;    // pages read() mapped rather than copied
+  uint64 nflush;   // transactions iflush() wrote delayed writes in
+};
+
+extern struct fsstat fsstats;
+
 // Map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
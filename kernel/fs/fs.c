@@ -14,6 +14,7 @@
 #include "../fs/file.h"
 #include "../fs/stat.h"
 #include "../include/defs.h"
+#include "../include/memlayout.h"
 #include "../include/param.h"
 #include "../include/riscv.h"
 #include "../include/types.h"
@@ -23,26 +24,48 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+extern struct spinlock tickslock;
+extern uint ticks;
+
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
+uint fsbsize = BSIZEMIN; // BSIZE, until fsinit() reads the super block
 
-// Read the super block.
+// Read the super block, which is at byte SBOFFSET whatever
+// the block size.
 // 从磁盘中读取超级块信息到 sb 结构体中
 static void readsb(int dev, struct superblock *sb) {
   struct buf *bp;
 
-  bp = bread(dev, 1);
-  memmove(sb, bp->data, sizeof(*sb));
+  bp = bread(dev, SBOFFSET / BSIZE);
+  memmove(sb, bp->data + SBOFFSET % BSIZE, sizeof(*sb));
   brelse(bp);
 }
 
+static void bsuminit(int dev);
+static void imapinit(int dev);
+static void flusher(void);
+
 // Init fs
 void fsinit(int dev) {
   readsb(dev, &sb);        // 读取超级块
   if (sb.magic != FSMAGIC) // 验证魔数
     panic("invalid file system");
+  if (sb.bsize == 0)
+    sb.bsize = BSIZEMIN;
+  if (sb.bsize < BSIZEMIN || sb.bsize > BSIZEMAX ||
+      (sb.bsize & (sb.bsize - 1)) != 0)
+    panic("fsinit: bad block size");
+  fsbsize = sb.bsize;
+  bresize(fsbsize);  // drops the super block's buffer too
   initlog(dev, &sb); // 初始化日志系统
+  bsuminit(dev);     // after recovery, which may change the bitmap
+  imapinit(dev);
+  dcacheinit();
+  pcacheinit();
+  if (kthread_create(flusher) < 0)
+    panic("fsinit: flusher");
 }
 
 // Zero a block.
@@ -50,40 +73,166 @@ void fsinit(int dev) {
 static void bzero(int dev, int bno) {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno, 0);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// bfreecnt[g] is the number of free blocks that bitmap block g
+// describes, so balloc() passes over full bitmap blocks without
+// reading them. It is built from the bitmap at boot and kept up
+// to date by balloc_run() and bfree(). An entry changes only
+// while its bitmap block is locked; reads without the lock are
+// just hints, and the bitmap itself is the final word.
+
+static int *bfreecnt;
+static int nbmap; // bitmap blocks
+
+struct fsstat fsstats; // counters; updates may race, which is fine
+
+// Count trailing zeros of x, which must not be 0.
+static int ctz64(uint64 x) {
+  int n = 0;
+
+  if ((x & 0xffffffff) == 0) { n += 32; x >>= 32; }
+  if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+  if ((x & 0xff) == 0) { n += 8; x >>= 8; }
+  if ((x & 0xf) == 0) { n += 4; x >>= 4; }
+  if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+  if ((x & 0x1) == 0) n += 1;
+  return n;
+}
+
+static int popcount64(uint64 x) {
+  x = x - ((x >> 1) & 0x5555555555555555UL);
+  x = (x & 0x3333333333333333UL) + ((x >> 2) & 0x3333333333333333UL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+  return (x * 0x0101010101010101UL) >> 56;
+}
+
+// Number of blocks bitmap block g describes.
+static int bmapbits(int g) {
+  return min(BPB, sb.size - g * BPB);
+}
+
+// Build bfreecnt[] from the on-disk bitmap.
+static void bsuminit(int dev) {
+  struct buf *bp;
+  uint64 *w;
+  int g, i, nbits, used;
+
+  nbmap = (sb.size + BPB - 1) / BPB;
+  if (nbmap > PAGESIZE / sizeof(int))
+    panic("bsuminit: bitmap too large");
+  if (bfreecnt == 0 && (bfreecnt = alloc_page()) == 0)
+    panic("bsuminit: alloc_page");
+  for (g = 0; g < nbmap; g++) {
+    bp = bread(dev, sb.bmapstart + g);
+    w = (uint64 *)bp->data;
+    nbits = bmapbits(g);
+    used = 0;
+    for (i = 0; i < nbits / 64; i++)
+      used += popcount64(w[i]);
+    if (nbits % 64)
+      used += popcount64(w[i] & ((1UL << (nbits % 64)) - 1));
+    bfreecnt[g] = nbits - used;
+    brelse(bp);
+  }
+}
+
+// In the first nbits bits of bitmap map, find a run of at least
+// minlen clear bits starting at or after bit bi, a 64-bit word at a
+// time. Returns its first bit and sets *len to its length, at
+// most n; -1 if there is none.
+static int bfind(uchar *map, int nbits, int bi, int n, int minlen,
+                 int *len) {
+  uint64 *w = (uint64 *)map, x;
+  int i, j;
+
+  while (bi < nbits) {
+    x = ~w[bi / 64] & (~0UL << (bi % 64)); // free bits from bi on
+    if (x == 0) {
+      bi += 64 - bi % 64;
+      continue;
+    }
+    i = bi - bi % 64 + ctz64(x);
+    if (i >= nbits)
+      break;
+    for (j = i; j < nbits && j - i < n;) {
+      x = w[j / 64] >> (j % 64); // used bits from j on
+      if (x & 1)
+        break;
+      j += x ? ctz64(x) : 64 - j % 64;
+    }
+    j = min(j, min(nbits, i + n));
+    if (j - i >= minlen) {
+      *len = j - i;
+      return i;
+    }
+    bi = j;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Allocate up to n consecutive disk blocks, not zeroed, and
+// return the first, setting *got to how many. Prefers, in order: the
+// goal block itself, so a file's blocks follow one another; a
+// run of all n blocks at or after goal, wrapping around; and
+// then any free block.
 // returns 0 if out of disk space.
 // 分配磁盘块
-static uint balloc(uint dev) {
-  int b, bi, m;
+static uint balloc_run(uint dev, uint goal, int n, int *got) {
+  int pass, k, g, bi, i, j, len, minlen;
   struct buf *bp;
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb));
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) { // Is block free?
-        bp->data[bi / 8] |= m;           // Mark block in use.
-        log_write(bp);
+  if (goal >= sb.size)
+    goal = 0;
+  for (pass = 0; pass < 2; pass++) {
+    g = goal / BPB;
+    bi = goal % BPB;
+    // every bitmap block, then the first one again for the
+    // blocks before goal.
+    for (k = 0; k <= nbmap; k++) {
+      minlen = pass == 0 ? n : 1;
+      if (bfreecnt[g] >= minlen || (k == 0 && bfreecnt[g] > 0)) {
+        bp = bread(dev, sb.bmapstart + g);
+        fsstats.nbscan++;
+        if (k == 0 && (bp->data[bi / 8] & (1 << (bi % 8))) == 0)
+          minlen = 1; // the goal block is free
+        if ((i = bfind(bp->data, bmapbits(g), bi, n, minlen, &len)) >= 0) {
+          for (j = i; j < i + len; j++)
+            bp->data[j / 8] |= 1 << (j % 8); // Mark blocks in use.
+          bfreecnt[g] -= len;
+          log_write(bp);
+          brelse(bp);
+          fsstats.nballoc += len;
+          *got = len;
+          return g * BPB + i;
+        }
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
       }
+      bi = 0;
+      g = (g + 1) % nbmap;
     }
-    brelse(bp);
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a zeroed disk block, preferably goal.
+// returns 0 if out of disk space.
+static uint balloc(uint dev, uint goal) {
+  uint b;
+  int got;
+
+  if ((b = balloc_run(dev, goal, 1, &got)) != 0)
+    bzero(dev, b);
+  return b;
+}
+
 // Free a disk block.
 static void bfree(int dev, uint b) {
   struct buf *bp;
@@ -95,6 +244,7 @@ static void bfree(int dev, uint b) {
   if ((bp->data[bi / 8] & m) == 0)
     panic("freeing free block");
   bp->data[bi / 8] &= ~m;
+  bfreecnt[b / BPB]++;
   log_write(bp);
   brelse(bp);
 }
@@ -129,13 +279,15 @@ static void bfree(int dev, uint b) {
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. A free entry keeps its inode, on an LRU
+//   list, until iget() needs the entry for another one.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode. So an inode that
+//   was used recently needs no disk read to lock again.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,50 +314,162 @@ static void bfree(int dev, uint b) {
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those fields,
+// or the hash chains and LRU list that link the entries.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+// The table has an entry per INODEMEM bytes of RAM, and at
+// least NINODE.
+#define INODEMEM (256 * 1024)
+#define IHASH(dev, inum) (((inum) * 31 + (dev)) & (itable.nhash - 1))
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *inode; // ninode entries
+  int ninode;
+  struct inode **hash; // nhash chains of entries, by dev and inum
+  int nhash;
+  // free entries, least recently used first. lru.lnext is
+  // the one to reuse next.
+  struct inode lru;
 } itable;
 
+// Put ip on the LRU list: at the end, or, for an entry that
+// holds nothing worth keeping, at the front.
+static void lru_insert(struct inode *ip, int end) {
+  struct inode *at = end ? itable.lru.lprev : &itable.lru;
+
+  ip->lprev = at;
+  ip->lnext = at->lnext;
+  at->lnext->lprev = ip;
+  at->lnext = ip;
+}
+
+static void lru_remove(struct inode *ip) {
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+}
+
 // 初始化 inode 表
 void iinit(void) {
-  int i = 0;
+  struct inode *ip;
+  int npages;
 
   initlock(&itable.lock, "itable");
-  for (i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.ninode = (PHYSTOP - KERNBASE) / INODEMEM;
+  if (itable.ninode < NINODE)
+    itable.ninode = NINODE;
+  for (itable.nhash = 1; itable.nhash < itable.ninode; itable.nhash *= 2)
+    ;
+  npages = (itable.ninode * sizeof(struct inode) +
+            itable.nhash * sizeof(struct inode *) + PAGESIZE - 1) / PAGESIZE;
+  if ((itable.inode = alloc_pages(npages)) == 0)
+    panic("iinit: alloc_pages");
+  memset(itable.inode, 0, npages * PAGESIZE);
+  itable.hash = (struct inode **)(itable.inode + itable.ninode);
+
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+  for (ip = itable.inode; ip < &itable.inode[itable.ninode]; ip++) {
+    initsleeplock(&ip->lock, "inode");
+    lru_insert(ip, 1);
   }
 }
 
 static struct inode *iget(uint dev, uint inum);
+static void run_clear(struct inode *ip);
+
+// imap has a bit set for each inode in use, so ialloc() finds
+// a free inode without reading inode blocks. It is rebuilt from
+// the inodes at boot, and an inode's bit is set from when
+// ialloc() claims it until iput() frees it.
+struct {
+  struct spinlock lock;
+  uchar *map;
+  uint hint; // where the last search that left its block ended
+} imap;
 
-// Allocate an inode on device dev.
+// Build imap from the on-disk inodes.
+static void imapinit(int dev) {
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum, npages;
+
+  initlock(&imap.lock, "imap");
+  npages = (sb.ninodes / 8 + PAGESIZE - 1) / PAGESIZE;
+  if (imap.map == 0 && (imap.map = alloc_pages(npages)) == 0)
+    panic("imapinit: alloc_pages");
+  memset(imap.map, 0, npages * PAGESIZE);
+  imap.map[0] = 1; // inode 0 is never used
+  for (inum = 1, bp = 0; inum < sb.ninodes; inum++) {
+    if (bp == 0 || inum % IPB == 0) {
+      if (bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode *)bp->data + inum % IPB;
+    if (dip->type != 0)
+      imap.map[inum / 8] |= 1 << (inum % 8);
+  }
+  if (bp)
+    brelse(bp);
+  imap.hint = 1;
+}
+
+// Claim a free inode in imap: one in the same inode block as
+// inode near if there is one, so a directory and its files
+// share inode blocks, else the next one from imap.hint on.
+// returns 0 if there are none.
+static uint imap_alloc(uint near) {
+  uint first = near - near % IPB;
+  int i, len;
+
+  acquire(&imap.lock);
+  i = bfind(imap.map, min(first + IPB, sb.ninodes), first, 1, 1, &len);
+  if (i < 0) {
+    if ((i = bfind(imap.map, sb.ninodes, imap.hint, 1, 1, &len)) < 0)
+      i = bfind(imap.map, imap.hint, 1, 1, 1, &len);
+    if (i >= 0)
+      imap.hint = i + 1;
+  }
+  if (i >= 0)
+    imap.map[i / 8] |= 1 << (i % 8);
+  release(&imap.lock);
+  return i < 0 ? 0 : i;
+}
+
+static void imap_free(uint inum) {
+  acquire(&imap.lock);
+  imap.map[inum / 8] &= ~(1 << (inum % 8));
+  release(&imap.lock);
+}
+
+// Allocate an inode on device dev, near inode near (usually
+// the new file's directory).
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 // 分配 inode
-struct inode *ialloc(uint dev, short type) {
-  int inum;
+struct inode *ialloc(uint dev, short type, uint near) {
+  uint inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for (inum = 1; inum < sb.ninodes; inum++) {
+  while ((inum = imap_alloc(near)) != 0) {
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode *)bp->data + inum % IPB;
     if (dip->type == 0) { // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if (type != T_DEVICE) // new files and directories use extents
+        dip->flags = I_EXTENTS;
       log_write(bp); // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
     }
-    brelse(bp);
+    brelse(bp); // in use after all; leave its bit set
   }
   printf("ialloc: no inodes\n");
   return 0;
@@ -225,7 +489,8 @@ void iupdate(struct inode *ip) {
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
+  dip->size = ip->dsize; // delayed writes have no blocks yet
+  dip->flags = ip->flags;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
@@ -235,31 +500,37 @@ void iupdate(struct inode *ip) {
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
+  for (ip = itable.hash[IHASH(dev, inum)]; ip != 0; ip = ip->hnext) {
+    if (ip->dev == dev && ip->inum == inum) {
+      if (ip->ref++ == 0)
+        lru_remove(ip);
       release(&itable.lock);
       return ip;
     }
-    if (empty == 0 && ip->ref == 0) // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if (empty == 0)
+  // Recycle the least recently used free entry.
+  if ((ip = itable.lru.lnext) == &itable.lru)
     panic("iget: no inodes");
+  lru_remove(ip);
+  if (ip->inum != 0) { // take it off its old hash chain
+    for (pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip;
+         pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -292,8 +563,14 @@ void ilock(struct inode *ip) {
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
-    ip->size = dip->size;
+    ip->size = ip->dsize = dip->size;
+    ip->flags = dip->flags;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    fsstats.niread++;
+    run_clear(ip);
+    ip->goal = 0;
+    ip->pawant = 0;
+    ip->pa.len = 0;
     brelse(bp);
     ip->valid = 1;
     if (ip->type == 0)
@@ -328,9 +605,12 @@ void iput(struct inode *ip) {
 
     release(&itable.lock);
 
+    if (ip->type == T_DIR) // its inode number may be reused
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    imap_free(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
@@ -338,7 +618,8 @@ void iput(struct inode *ip) {
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if (--ip->ref == 0)
+    lru_insert(ip, ip->valid);
   release(&itable.lock);
 }
 
@@ -351,20 +632,290 @@ void iunlockput(struct inode *ip) {
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, mapped in one of two ways.
+//
+// Classic: the first NDIRECT block numbers are listed in
+// ip->addrs[].  The next NINDIRECT blocks are listed in
+// block ip->addrs[NDIRECT], the next NDINDIRECT through the
+// double-indirect block ip->addrs[NDIRECT + 1], and the next
+// NTINDIRECT through the triple-indirect block ip->addrs[NDIRECT + 2].
+//
+// Extents (ip->flags & I_EXTENTS): ip->ext lists runs of
+// consecutive blocks, NIEXTENT in the inode and NXEXTENT more
+// in each of the extent blocks listed by index block
+// ip->ext.blk. A file that grows into the block after
+// its last one just lengthens its last extent, so a file laid
+// out contiguously needs one extent however large it is.
+//
+// Either way, bmap() keeps the runs of blocks it has resolved
+// in ip->runs[], so sequential access reads an indirect or
+// extent block once per run instead of once per block.
+//
+// Inline (ip->flags & I_INLINE): a regular file of at most
+// NINLINE bytes has no blocks at all; its bytes are in the
+// space of ip->addrs[], so reading it takes only the inode
+// block ilock() read. writeblocks() puts a small first write
+// there, and moves the bytes to a block when the file outgrows
+// it. Only extent-mapped files go inline, so that they come out
+// extent-mapped again.
+
+// Look bn up in ip's cached block mappings; 0 if not there.
+static uint run_lookup(struct inode *ip, uint bn) {
+  struct bmaprun *r;
+
+  for (r = ip->runs; r < &ip->runs[NBMAPRUN]; r++) {
+    if (r->e.len > 0 && bn >= r->base && bn - r->base < r->e.len) {
+      fsstats.nmaphit++;
+      return r->e.start + (bn - r->base);
+    }
+  }
+  return 0;
+}
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Remember that logical blocks [base, base + len) are at disk
+// blocks [start, start + len). A run with the same base, which
+// is now known to be longer, is replaced in place.
+static void run_insert(struct inode *ip, uint base, uint start, uint len) {
+  struct bmaprun *r;
+
+  for (r = ip->runs; r < &ip->runs[NBMAPRUN]; r++) {
+    if (r->e.len > 0 && r->base == base)
+      break;
+  }
+  if (r == &ip->runs[NBMAPRUN]) {
+    r = &ip->runs[ip->nextrun];
+    ip->nextrun = (ip->nextrun + 1) % NBMAPRUN;
+  }
+  r->base = base;
+  r->e.start = start;
+  r->e.len = len;
+}
+
+static void run_clear(struct inode *ip) {
+  memset(ip->runs, 0, sizeof(ip->runs));
+  ip->nextrun = 0;
+}
+
+// Files start BGROUP blocks (8MB) apart, by inode number: a
+// bitmap block's worth with 1KB blocks, but not with larger
+// ones, where a bitmap block may cover the whole disk.
+#define BGROUP (8 * 1024 * 1024 / BSIZE)
+
+// Allocate a data or indirect block for ip, preferably goal;
+// 0 means just after the last block ip got, or, for a file that
+// has none yet, in a BGROUP stretch picked by inode number, so
+// that files written at the same time do not interleave.
+// The block is zeroed unless full says the caller will
+// overwrite all of it.
 // returns 0 if out of disk space.
-static uint bmap(struct inode *ip, uint bn) {
+static uint balloc_data(struct inode *ip, uint goal, int full) {
+  uint addr;
+  int len;
+
+  if (goal == 0)
+    goal = ip->goal ? ip->goal
+                    : (ip->inum % ((sb.size + BGROUP - 1) / BGROUP)) * BGROUP;
+  if (ip->pa.len == 0 && ip->pawant > 1) {
+    ip->pa.start = balloc_run(ip->dev, goal, ip->pawant, &len);
+    ip->pa.len = ip->pa.start ? len : 0;
+  }
+  if (ip->pa.len > 0) {
+    addr = ip->pa.start++;
+    ip->pa.len--;
+  } else if ((addr = balloc_run(ip->dev, goal, 1, &len)) == 0) {
+    return 0;
+  }
+  if (!full)
+    bzero(ip->dev, addr);
+  if (ip->pawant > 0)
+    ip->pawant--;
+  ip->goal = addr + 1;
+  return addr;
+}
+
+// Extent i of ip, from the inode or from the extent block
+// holding it, which the caller has read into bp.
+static struct extent *iext(struct inode *ip, struct buf *bp, int i) {
+  if (i < NIEXTENT)
+    return &ip->ext.e[i];
+  return (struct extent *)bp->data + (i - NIEXTENT) % NXEXTENT;
+}
+
+// Is extent i the first in its extent block?
+#define XFIRST(i) ((i) >= NIEXTENT && ((i) - NIEXTENT) % NXEXTENT == 0)
+
+// Read the extent block holding extent i (>= NIEXTENT) of ip.
+// With alloc, allocate it, and the index block, if missing.
+// Returns 0 if there is none, or no disk space for one.
+static struct buf *extblock(struct inode *ip, int i, int alloc) {
+  struct buf *bp;
   uint addr, *a;
+
+  if (ip->ext.blk == 0 &&
+      (!alloc || (ip->ext.blk = balloc(ip->dev, 0)) == 0))
+    return 0;
+  bp = bread(ip->dev, ip->ext.blk);
+  fsstats.nmapread++;
+  a = (uint *)bp->data + (i - NIEXTENT) / NXEXTENT;
+  if ((addr = *a) == 0 && alloc && (addr = balloc(ip->dev, 0)) != 0) {
+    *a = addr;
+    log_write(bp);
+  }
+  brelse(bp);
+  if (addr == 0)
+    return 0;
+  fsstats.nmapread++;
+  return bread(ip->dev, addr);
+}
+
+// bmap() for extent-mapped inodes.
+static uint bmap_ext(struct inode *ip, uint bn, int full) {
+  struct buf *bp = 0, *nbp;
+  struct extent *e = 0;
+  uint base = 0, ebase = 0, addr = 0;
+  int i, ei = -1;
+
+  // walk the extents; e is the last one seen, extent ei,
+  // covering logical blocks [ebase, base), in bp if past the
+  // inode. An extent block is let go only once the next one
+  // has an extent.
+  for (i = 0; i < NEXTENT; i++) {
+    if (XFIRST(i)) {
+      if ((nbp = extblock(ip, i, 0)) == 0)
+        break;
+      if (((struct extent *)nbp->data)->len == 0) {
+        brelse(nbp);
+        break;
+      }
+      if (bp)
+        brelse(bp);
+      bp = nbp;
+    }
+    if (iext(ip, bp, i)->len == 0)
+      break;
+    e = iext(ip, bp, i);
+    ei = i;
+    ebase = base;
+    base += e->len;
+    if (bn < base)
+      goto found;
+  }
+
+  // not mapped yet: bn must be the block after the last one.
+  if (bn != base)
+    panic("bmap: hole");
+  addr = balloc_data(ip, e ? e->start + e->len : 0, full);
+  if (addr == 0)
+    goto out;
+  if (e && addr == e->start + e->len) {
+    e->len++; // grow the last extent in place
+  } else {
+    if (i == NEXTENT) { // out of extents
+      bfree(ip->dev, addr);
+      addr = 0;
+      goto out;
+    }
+    if (XFIRST(i)) { // first extent of an extent block
+      if ((nbp = extblock(ip, i, 1)) == 0) {
+        bfree(ip->dev, addr);
+        addr = 0;
+        goto out;
+      }
+      if (bp)
+        brelse(bp);
+      bp = nbp;
+    }
+    e = iext(ip, bp, i);
+    ei = i;
+    e->start = addr;
+    e->len = 1;
+    ebase = base;
+  }
+  // the inode itself is written by the caller (writei).
+  if (ei >= NIEXTENT)
+    log_write(bp);
+
+found:
+  run_insert(ip, ebase, e->start, e->len);
+  addr = e->start + (bn - ebase);
+out:
+  if (bp)
+    brelse(bp);
+  return addr;
+}
+
+// Look up entry bn of the level-deep tree of indirect blocks
+// rooted at *root (level 0 is a single indirect block), whose
+// first entry maps logical block base. Allocates missing blocks.
+// The run of consecutive blocks around bn in its indirect block
+// goes into ip->runs[]. returns 0 if out of disk space.
+static uint bmap_ind(struct inode *ip, uint *root, int level, uint bn,
+                     uint base, int full) {
+  uint addr, span, i, lo, hi, *a;
   struct buf *bp;
 
+  if ((addr = *root) == 0) {
+    addr = balloc_data(ip, 0, 0);
+    if (addr == 0)
+      return 0;
+    *root = addr; // the inode is written by the caller (writei)
+  }
+
+  for (span = 1; level > 0; level--)
+    span *= NINDIRECT;
+  for (;;) {
+    bp = bread(ip->dev, addr);
+    fsstats.nmapread++;
+    a = (uint *)bp->data;
+    i = bn / span;
+    if ((addr = a[i]) == 0) {
+      if (span == 1)
+        addr = balloc_data(ip, i > 0 && a[i - 1] ? a[i - 1] + 1 : 0, full);
+      else
+        addr = balloc_data(ip, 0, 0);
+      if (addr == 0) {
+        brelse(bp);
+        return 0;
+      }
+      a[i] = addr;
+      log_write(bp);
+    }
+    if (span == 1)
+      break;
+    brelse(bp);
+    bn %= span;
+    base += i * span;
+    span /= NINDIRECT;
+  }
+
+  // a leaf: find the run of consecutive blocks around bn.
+  for (lo = i; lo > 0 && a[lo - 1] && a[lo - 1] + 1 == a[lo]; lo--)
+    ;
+  for (hi = i; hi + 1 < NINDIRECT && a[hi + 1] && a[hi] + 1 == a[hi + 1]; hi++)
+    ;
+  run_insert(ip, base + lo, a[lo], hi - lo + 1);
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, zeroed unless
+// full says the caller will overwrite all of it.
+// returns 0 if out of disk space.
+static uint bmap(struct inode *ip, uint bn, int full) {
+  uint addr;
+
+  if ((addr = run_lookup(ip, bn)) != 0)
+    return addr;
+
+  if (ip->flags & I_INLINE)
+    panic("bmap: inline");
+  if (ip->flags & I_EXTENTS)
+    return bmap_ext(ip, bn, full);
+
   if (bn < NDIRECT) {
     if ((addr = ip->addrs[bn]) == 0) {
-      addr = balloc(ip->dev);
+      addr = balloc_data(ip, bn > 0 ? ip->addrs[bn - 1] + 1 : 0, full);
       if (addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -373,36 +924,98 @@ static uint bmap(struct inode *ip, uint bn) {
   }
   bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
-    // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0) {
-      addr = balloc(ip->dev);
-      if (addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      addr = balloc(ip->dev);
-      if (addr) {
-        a[bn] = addr;
-        log_write(bp);
-      }
+  if (bn < NINDIRECT)
+    return bmap_ind(ip, &ip->addrs[NDIRECT], 0, bn, NDIRECT, full);
+  bn -= NINDIRECT;
+
+  if (bn < NDINDIRECT)
+    return bmap_ind(ip, &ip->addrs[NDIRECT + 1], 1, bn,
+                    NDIRECT + NINDIRECT, full);
+  bn -= NDINDIRECT;
+
+  if (bn < NTINDIRECT)
+    return bmap_ind(ip, &ip->addrs[NDIRECT + 2], 2, bn,
+                    NDIRECT + NINDIRECT + NDINDIRECT, full);
+
+  panic("bmap: out of range");
+}
+
+// Free the n extents at e and the blocks they map, stopping at
+// one of length 0.
+static void free_extents(struct inode *ip, struct extent *e, int n) {
+  for (; n > 0 && e->len > 0; n--, e++) {
+    for (uint j = 0; j < e->len; j++)
+      bfree(ip->dev, e->start + j);
+  }
+}
+
+// Free the blocks of an extent-mapped inode.
+static void itrunc_ext(struct inode *ip) {
+  struct buf *ibp, *bp;
+  uint k, *a;
+
+  free_extents(ip, ip->ext.e, NIEXTENT);
+  if (ip->ext.blk) {
+    ibp = bread(ip->dev, ip->ext.blk);
+    a = (uint *)ibp->data;
+    for (k = 0; k < NINDIRECT && a[k]; k++) {
+      bp = bread(ip->dev, a[k]);
+      free_extents(ip, (struct extent *)bp->data, NXEXTENT);
+      brelse(bp);
+      bfree(ip->dev, a[k]);
     }
-    brelse(bp);
-    return addr;
+    brelse(ibp);
+    bfree(ip->dev, ip->ext.blk);
   }
+  memset(&ip->ext, 0, sizeof(ip->ext));
+}
 
-  panic("bmap: out of range");
+// Free indirect block addr, level levels above the data
+// blocks, and everything it maps.
+static void itrunc_ind(struct inode *ip, uint addr, int level) {
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint *)bp->data;
+  for (j = 0; j < NINDIRECT; j++) {
+    if (a[j] == 0)
+      continue;
+    if (level > 0)
+      itrunc_ind(ip, a[j], level - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
 }
 
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void itrunc(struct inode *ip) {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  pcache_trunc(ip);
+  if (ip->size != ip->dsize) {
+    // drop the page cache's reference; the caller holds another.
+    acquire(&itable.lock);
+    ip->ref--;
+    release(&itable.lock);
+  }
+  ip->size = ip->dsize = 0;
+  run_clear(ip);
+  if (ip->flags & I_INLINE) {
+    ip->flags &= ~I_INLINE;
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    iupdate(ip);
+    return;
+  }
+  if (ip->flags & I_EXTENTS) {
+    itrunc_ext(ip);
+    iupdate(ip);
+    return;
+  }
 
   for (i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i]) {
@@ -411,22 +1024,21 @@ void itrunc(struct inode *ip) {
     }
   }
 
-  if (ip->addrs[NDIRECT]) {
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint *)bp->data;
-    for (j = 0; j < NINDIRECT; j++) {
-      if (a[j])
-        bfree(ip->dev, a[j]);
+  for (i = 0; i < 3; i++) {
+    if (ip->addrs[NDIRECT + i]) {
+      itrunc_ind(ip, ip->addrs[NDIRECT + i], i);
+      ip->addrs[NDIRECT + i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
-  ip->size = 0;
   iupdate(ip);
 }
 
+// Copy the file system counters into *st.
+void fsstat(struct fsstat *st) {
+  *st = fsstats;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void stati(struct inode *ip, struct stat *st) {
@@ -442,30 +1054,153 @@ void stati(struct inode *ip, struct stat *st) {
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
-  uint tot, m;
+  uint tot, m, end;
   struct buf *bp;
+  int r;
 
   if (off > ip->size || off + n < off)
     return 0;
   if (off + n > ip->size)
     n = ip->size - off;
+  // bytes past ip->dsize are delayed writes, only in the page cache.
+  end = off < ip->dsize ? min(n, ip->dsize - off) : 0;
+
+  tot = 0;
+  if (ip->flags & I_INLINE) {
+    if (either_copyout(user_dst, dst, (char *)ip->addrs + off, end) == -1)
+      return -1;
+    tot = end;
+    off += end;
+    dst += end;
+  }
+  for (; tot < end; tot += m, off += m, dst += m) {
+    uint addr = bmap(ip, off / BSIZE, 0);
+    if (addr == 0)
+      return tot;
+    bp = ip->type == T_FILE ? bread_data(ip->dev, addr) : bread(ip->dev, addr);
+    m = min(end - tot, BSIZE - off % BSIZE);
+    if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+      brelse(bp);
+      return -1;
+    }
+    brelse(bp);
+  }
+  if (tot < n) {
+    if ((r = pcache_read(ip, user_dst, dst, off, n - tot)) < 0)
+      return -1;
+    tot += r;
+  }
+  return tot;
+}
+
+// writeblocks() for a write that leaves ip within NINLINE bytes:
+// the bytes go into ip->addrs[], for the caller's iupdate().
+static int writeinline(struct inode *ip, int user_src, uint64 src, uint off,
+                       uint n, int cache) {
+  char data[NINLINE];
+
+  // copy in first, so that a bad src leaves ip->addrs[] alone.
+  if (either_copyin(data, user_src, src, n) == -1)
+    return 0;
+  ip->flags |= I_INLINE;
+  memmove((char *)ip->addrs + off, data, n);
+  if (cache)
+    pcache_write(ip, off, data, n);
+  if (off + n > ip->dsize)
+    ip->dsize = off + n;
+  if (ip->dsize > ip->size)
+    ip->size = ip->dsize;
+  return n;
+}
+
+// Move inline ip's bytes to a block of their own, for a write
+// that takes it past NINLINE bytes. returns -1 if out of disk
+// space, with ip still inline.
+static int uninline(struct inode *ip) {
+  char data[NINLINE];
+  struct buf *bp;
+  uint addr;
+
+  memmove(data, ip->addrs, ip->dsize);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags &= ~I_INLINE;
+  ip->pawant++; // block 0, which the caller counted as there
+  if ((addr = bmap(ip, 0, 1)) == 0) {
+    ip->flags |= I_INLINE;
+    memmove(ip->addrs, data, ip->dsize);
+    return -1;
+  }
+  bp = bnew(ip->dev, addr, 1);
+  memset(bp->data, 0, BSIZE);
+  memmove(bp->data, data, ip->dsize);
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
 
-  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-    uint addr = bmap(ip, off / BSIZE);
+// Write n bytes from src at off in ip's blocks, allocating
+// the ones it lacks; with cache, bring the page cache up to
+// date too. The caller sets ip->pawant, and gives back what
+// bmap() allocated ahead, with pa_release(). A small file's
+// bytes go in the inode instead, while they fit.
+// Returns the number of bytes written.
+static int writeblocks(struct inode *ip, int user_src, uint64 src, uint off,
+                       uint n, int cache) {
+  uint tot, m, nold;
+  struct buf *bp;
+  int full;
+
+  if (n > 0 && off + n <= NINLINE &&
+      ((ip->flags & I_INLINE) ||
+       (ip->type == T_FILE && (ip->flags & I_EXTENTS) && ip->dsize == 0 &&
+        ip->ext.e[0].len == 0)))
+    return writeinline(ip, user_src, src, off, n, cache);
+  if ((ip->flags & I_INLINE) && uninline(ip) < 0)
+    return 0;
+
+  nold = (ip->dsize + BSIZE - 1) / BSIZE; // blocks that hold data
+  for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    m = min(n - tot, BSIZE - off % BSIZE);
+    // a block past the old end that this write fills completely
+    // need not be zeroed by bmap() nor read here.
+    full = off / BSIZE >= nold && m == BSIZE;
+    uint addr = bmap(ip, off / BSIZE, full);
     if (addr == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off % BSIZE);
-    if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if (full)
+      bp = bnew(ip->dev, addr, ip->type == T_FILE);
+    else
+      bp = ip->type == T_FILE ? bread_data(ip->dev, addr)
+                              : bread(ip->dev, addr);
+    if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if (full) { // don't leave what a freed file had there
+        memset(bp->data, 0, BSIZE);
+        log_write(bp);
+      }
       brelse(bp);
-      tot = -1;
       break;
     }
+    if (cache)
+      pcache_write(ip, off, (char *)bp->data + off % BSIZE, m);
+    log_write(bp);
     brelse(bp);
   }
+
+  if (off > ip->dsize)
+    ip->dsize = off;
+  if (ip->dsize > ip->size)
+    ip->size = ip->dsize;
   return tot;
 }
 
+// Give back blocks bmap() allocated for a write that came up
+// short.
+static void pa_release(struct inode *ip) {
+  ip->pawant = 0;
+  for (; ip->pa.len > 0; ip->pa.len--)
+    bfree(ip->dev, ip->pa.start++);
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -474,73 +1209,486 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
 // If the return value is less than the requested n,
 // there was an error of some kind.
 int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
-  uint tot, m;
-  struct buf *bp;
+  uint64 nalloc = fsstats.nballoc;
+  uint dsize = ip->dsize, m;
+  int r;
 
   if (off > ip->size || off + n < off)
     return -1;
-  if (off + n > MAXFILE * BSIZE)
+  if (!(ip->flags & I_EXTENTS) && (uint64)off + n > MAXFILE * BSIZE)
     return -1;
 
-  for (tot = 0; tot < n; tot += m, off += m, src += m) {
-    uint addr = bmap(ip, off / BSIZE);
-    if (addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off % BSIZE);
-    if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-      brelse(bp);
+  if (ip->size > ip->dsize && off + n > ip->dsize) {
+    // the file has delayed writes; past them, this one joins them.
+    m = off < ip->dsize ? ip->dsize - off : 0;
+    if (m > 0 && (r = writei(ip, user_src, src, off, m)) != m)
+      return r;
+    return m + pcache_delay(ip, user_src, src + m, off + m, n - m);
+  }
+
+  if (off + n > ip->dsize) // blocks past the end, for balloc_data()
+    ip->pawant = (off + n + BSIZE - 1) / BSIZE - (dsize + BSIZE - 1) / BSIZE;
+  r = writeblocks(ip, user_src, src, off, n, 1);
+  pa_release(ip);
+
+  // the i-node changed if the file grew, or bmap() added a
+  // block to ip->addrs[] or ip->ext, or the data is in it.
+  if (ip->dsize != dsize || fsstats.nballoc != nalloc ||
+      (ip->flags & I_INLINE))
+    iupdate(ip);
+
+  return r;
+}
+
+// Give ip's delayed writes blocks, allocated a transaction's
+// worth at a time so that they come out contiguous, and write
+// them through the log. An unlinked file's are dropped.
+// Caller holds a reference to ip, but not ip->lock, and is
+// not in a transaction.
+void iflush(struct inode *ip) {
+  int max = ((log_maxop() - 1 - 1 - 2) / 2) * BSIZE;
+  uint64 nalloc;
+  uint off, end, m, dsize;
+  int done = 0;
+
+  if (ip->size == ip->dsize) // a hint, without ip->lock
+    return;
+  while (!done) {
+    begin_op((max / BSIZE) * 2 + 1 + 1 + 2);
+    ilock(ip);
+    off = dsize = ip->dsize;
+    if (ip->size == dsize) { // someone else finished
+      iunlock(ip);
+      end_op();
       break;
     }
-    log_write(bp);
-    brelse(bp);
+    if (ip->nlink == 0) {
+      pcache_trunc(ip);
+      ip->size = dsize;
+    } else {
+      nalloc = fsstats.nballoc;
+      end = min(ip->size, off + max);
+      ip->pawant = (end + BSIZE - 1) / BSIZE - (off + BSIZE - 1) / BSIZE;
+      for (; off < end; off += m) {
+        m = min(end - off, PAGESIZE - off % PAGESIZE);
+        if (writeblocks(ip, 0,
+                        (uint64)pcache_dirtypage(ip, off / PAGESIZE) +
+                            off % PAGESIZE,
+                        off, m, 0) != m)
+          break;
+      }
+      pa_release(ip);
+      if (ip->dsize != dsize || fsstats.nballoc != nalloc)
+        iupdate(ip);
+      pcache_clean(ip, dsize, ip->dsize);
+      fsstats.nflush++;
+      if (off < end) { // out of disk space; try again later
+        iunlock(ip);
+        end_op();
+        break;
+      }
+    }
+    done = ip->size == ip->dsize;
+    iunlock(ip);
+    if (done)
+      iput(ip); // the page cache's reference
+    end_op();
   }
+}
 
-  if (off > ip->size)
-    ip->size = off;
+// blocks of the inode's data isync() hands to bsync() at once.
+#define SYNCBATCH 32
+
+// Write ip's committed blocks home for fsync(): its data blocks,
+// the block holding its dinode, and its extent index block or
+// top indirect blocks; deeper indirect and extent blocks are left
+// to the flusher. Caller holds ip->lock, and has written out ip's
+// delayed writes with iflush(). Returns the number of blocks
+// written.
+int isync(struct inode *ip) {
+  uint a[SYNCBATCH + 4];
+  uint bn, nb = (ip->dsize + BSIZE - 1) / BSIZE;
+  int i, n = 0, tot = 0;
+
+  a[n++] = IBLOCK(ip->inum, sb);
+  if (ip->flags & I_INLINE) { // the data is in the dinode
+    nb = 0;
+  } else if (ip->flags & I_EXTENTS) {
+    if (ip->ext.blk)
+      a[n++] = ip->ext.blk;
+  } else {
+    for (i = 0; i < 3; i++) {
+      if (ip->addrs[NDIRECT + i])
+        a[n++] = ip->addrs[NDIRECT + i];
+    }
+  }
+  for (bn = 0; bn < nb; bn++) {
+    if ((a[n] = bmap(ip, bn, 0)) != 0) // mapped already
+      n++;
+    if (n >= SYNCBATCH) {
+      tot += bsync(ip->dev, a, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    tot += bsync(ip->dev, a, n);
+  return tot;
+}
 
-  // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
-  iupdate(ip);
+// ticks a delayed write waits before the flusher writes it out.
+#define FLUSHTICKS 10
 
-  return tot;
+// Writes out delayed writes that have waited FLUSHTICKS ticks,
+// or all of them when the page cache is short of clean pages,
+// then writes home buffers that have been dirty for as long.
+static void flusher(void) {
+  struct inode *ip;
+  uint ticks0;
+
+  for (;;) {
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while (ticks - ticks0 < FLUSHTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    for (ip = itable.inode; ip < &itable.inode[itable.ninode]; ip++) {
+      // size, dsize and dticks without ip->lock are only a hint;
+      // iflush() looks again.
+      acquire(&itable.lock);
+      if (ip->ref == 0 || ip->size == ip->dsize ||
+          (ticks - ip->dticks < FLUSHTICKS && !pcache_busy())) {
+        release(&itable.lock);
+        continue;
+      }
+      ip->ref++;
+      release(&itable.lock);
+      iflush(ip);
+      begin_op(MAXOPBLOCKS);
+      iput(ip);
+      end_op();
+    }
+    bflush(ROOTDEV, FLUSHTICKS);
+  }
 }
 
 // Directories
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
+// A name as a dirent holds it, zero-padded to DIRSIZ, so that
+// it compares with a dirent's name a word at a time.
+union dirkey {
+  char c[DIRSIZ];
+  uint w[DIRSIZ / sizeof(uint)];
+};
+
+static void dirkey(union dirkey *k, char *name) { strncpy(k->c, name, DIRSIZ); }
+
+// namecmp() for a key and a dirent's name; 0 if they are equal.
+static int namecmpw(union dirkey *k, struct dirent *de) {
+  uint *w = (uint *)de->name;
+  uint d = 0;
+
+  for (int i = 0; i < DIRSIZ / sizeof(uint); i++)
+    d |= k->w[i] ^ w[i];
+  return d != 0;
+}
+
+// Hash of a name, for hashed directories.
+static uint dirhash(char *name) {
+  int n;
+
+  for (n = 0; n < DIRSIZ && name[n]; n++)
+    ;
+  return crc32c(0, name, n);
+}
+
+// Logical block lbn of directory dp, read; allocated (and
+// zeroed) if it is the block after the last one.
+static struct buf *dirblock(struct inode *dp, uint lbn) {
+  uint addr;
+
+  if ((addr = bmap(dp, lbn, 0)) == 0)
+    panic("dirblock");
+  return bread(dp->dev, addr);
+}
+
+// The header slot of a hashed directory's table block 1 or of
+// one of its leaves.
+static struct htslot *hthdr(struct buf *bp) {
+  struct htslot *hs = (struct htslot *)bp->data;
+
+  if (hs->inum != 0 || hs->v[0] != HTMAGIC)
+    panic("hashed directory: bad header");
+  return hs;
+}
+
+// Number of hash bits dp's table uses.
+static uint htdepth(struct inode *dp) {
+  struct buf *bp;
+  uint depth;
+
+  bp = dirblock(dp, 1);
+  depth = hthdr(bp)->v[1];
+  brelse(bp);
+  return depth;
+}
+
+// Table entry p of hashed directory dp, in buffer *bpp.
+static ushort *htptr(struct inode *dp, uint p, struct buf **bpp) {
+  uint q = p + HTPERSLOT; // the header comes first
+
+  *bpp = dirblock(dp, 1 + q / (DPB * HTPERSLOT));
+  return &((struct htslot *)(*bpp)->data)[q / HTPERSLOT % DPB]
+              .v[q % HTPERSLOT];
+}
+
+static uint htget(struct inode *dp, uint p) {
+  struct buf *bp;
+  uint leaf;
+
+  leaf = *htptr(dp, p, &bp);
+  brelse(bp);
+  return leaf;
+}
+
+static void htset(struct inode *dp, uint p, uint leaf) {
+  struct buf *bp;
+
+  *htptr(dp, p, &bp) = leaf;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Scan dp's dirents from byte off up to end for the one named
+// k, or, if k is 0, for a free one. Reads each block once and
+// looks at its dirents in place. Returns the dirent's offset and
+// sets *inum if inum is not 0, or returns end if there is none.
+static uint dirscan(struct inode *dp, uint off, uint end, union dirkey *k,
+                    uint *inum) {
+  struct buf *bp;
+  struct dirent *de, *e;
+
+  while (off < end) {
+    bp = dirblock(dp, off / BSIZE);
+    de = (struct dirent *)(bp->data + off % BSIZE);
+    e = de + min(end - off, BSIZE - off % BSIZE) / sizeof(*de);
+    for (; de < e; de++, off += sizeof(*de)) {
+      if (k == 0 ? de->inum == 0
+                 : (fsstats.ndirent++, de->inum != 0 && namecmpw(k, de) == 0))
+        break;
+    }
+    if (de < e) {
+      if (inum)
+        *inum = de->inum;
+      brelse(bp);
+      return off;
+    }
+    brelse(bp);
+  }
+  return end;
+}
+
+// dirlookup() for hashed directories: scan the one leaf that
+// name's hash leads to. Returns the inode number, 0 if name is
+// not there, and sets *poff.
+static uint htlookup(struct inode *dp, char *name, union dirkey *k,
+                     uint *poff) {
+  uint leaf, end, inum = 0;
+
+  leaf = htget(dp, dirhash(name) & ((1 << htdepth(dp)) - 1));
+  end = (leaf + 1) * BSIZE;
+  // slot 0 is the leaf header
+  *poff = dirscan(dp, leaf * BSIZE + sizeof(struct dirent), end, k, &inum);
+  return *poff == end ? 0 : inum;
+}
+
+// Turn dp, whose one block of dirents is full, into a hashed
+// directory: a table whose one entry leads to a new leaf, which
+// takes every name from block 0 but "." and "..".
+// Returns -1 if out of disk space.
+static int htconvert(struct inode *dp) {
+  struct buf *bp, *lp;
+  struct dirent *de, *lde;
+  uint lbn, leaf = HTBLOCKS + 1;
+  int i, j;
+
+  for (lbn = 1; lbn <= leaf; lbn++) {
+    if (bmap(dp, lbn, 0) == 0)
+      return -1;
+  }
+  dp->size = dp->dsize = (leaf + 1) * BSIZE;
+
+  bp = dirblock(dp, 1);
+  ((struct htslot *)bp->data)[0].v[0] = HTMAGIC; // depth 0
+  log_write(bp);
+  brelse(bp);
+  htset(dp, 0, leaf);
+
+  bp = dirblock(dp, 0);
+  lp = dirblock(dp, leaf);
+  de = (struct dirent *)bp->data;
+  lde = (struct dirent *)lp->data;
+  ((struct htslot *)lde)->v[0] = HTMAGIC; // depth 0
+  for (i = 0, j = 1; i < DPB; i++) {
+    if (de[i].inum == 0 || namecmp(de[i].name, ".") == 0 ||
+        namecmp(de[i].name, "..") == 0)
+      continue;
+    if (j == DPB)
+      panic("htconvert");
+    lde[j] = de[i];
+    memset(&de[i], 0, sizeof(de[i]));
+    dcache_enter(dp->dev, dp->inum, lde[j].name, lde[j].inum,
+                 leaf * BSIZE + j * sizeof(*lde));
+    j++;
+  }
+  log_write(bp);
+  log_write(lp);
+  brelse(lp);
+  brelse(bp);
+
+  dp->flags |= I_HASHDIR;
+  iupdate(dp);
+  return 0;
+}
+
+// Split leaf, the full leaf that hash h leads to, by one more
+// bit of hash, into itself and a new leaf at the end of dp,
+// doubling the table first if the leaf uses all its bits.
+// Returns -1 if that is not possible.
+static int htsplit(struct inode *dp, uint leaf, uint h) {
+  struct buf *bp, *np;
+  struct dirent *de, *nde;
+  uint depth, ldepth, nleaf, p, bit;
+  int i, j;
+
+  depth = htdepth(dp);
+  bp = dirblock(dp, leaf);
+  ldepth = hthdr(bp)->v[1];
+  brelse(bp);
+  if (ldepth == depth) {
+    if (depth == HTMAXDEPTH)
+      return -1;
+    for (p = 0; p < (1 << depth); p++)
+      htset(dp, p + (1 << depth), htget(dp, p));
+    bp = dirblock(dp, 1);
+    hthdr(bp)->v[1] = ++depth;
+    log_write(bp);
+    brelse(bp);
+  }
+
+  nleaf = dp->size / BSIZE;
+  if (nleaf > 0xffff || bmap(dp, nleaf, 0) == 0)
+    return -1;
+  dp->size = dp->dsize += BSIZE;
+  iupdate(dp);
+
+  bp = dirblock(dp, leaf);
+  np = dirblock(dp, nleaf);
+  de = (struct dirent *)bp->data;
+  nde = (struct dirent *)np->data;
+  hthdr(bp)->v[1] = ldepth + 1;
+  ((struct htslot *)nde)->v[0] = HTMAGIC;
+  ((struct htslot *)nde)->v[1] = ldepth + 1;
+  bit = 1 << ldepth;
+  for (i = 1, j = 1; i < DPB; i++) {
+    if (de[i].inum == 0 || (dirhash(de[i].name) & bit) == 0)
+      continue;
+    nde[j] = de[i];
+    memset(&de[i], 0, sizeof(de[i]));
+    dcache_enter(dp->dev, dp->inum, nde[j].name, nde[j].inum,
+                 nleaf * BSIZE + j * sizeof(*nde));
+    j++;
+  }
+  log_write(bp);
+  log_write(np);
+  brelse(np);
+  brelse(bp);
+
+  // the hashes that share the leaf's bits and have the new bit
+  // set now lead to the new leaf.
+  for (p = (h & (bit - 1)) | bit; p < (1 << depth); p += bit << 1)
+    htset(dp, p, nleaf);
+  return 0;
+}
+
+// dirlink() for hashed directories. Splits name's leaf for as
+// long as it is full, as when every name in it has the same
+// next hash bit; each split gives the leaf one more bit, so
+// there are at most HTMAXDEPTH, which HTOPBLOCKS allows for.
+static int htlink(struct inode *dp, char *name, uint inum) {
+  struct buf *bp;
+  struct dirent *de;
+  uint h = dirhash(name), leaf;
+  int i;
+
+  for (;;) {
+    leaf = htget(dp, h & ((1 << htdepth(dp)) - 1));
+    bp = dirblock(dp, leaf);
+    de = (struct dirent *)bp->data;
+    for (i = 1; i < DPB; i++) {
+      if (de[i].inum == 0)
+        break;
+    }
+    if (i < DPB) {
+      strncpy(de[i].name, name, DIRSIZ);
+      de[i].inum = inum;
+      log_write(bp);
+      brelse(bp);
+      dcache_enter(dp->dev, dp->inum, name, inum,
+                   leaf * BSIZE + i * sizeof(*de));
+      return 0;
+    }
+    brelse(bp);
+    if (htsplit(dp, leaf, h) < 0)
+      return -1;
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Asks the dcache first, and tells it what the search found.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, end;
+  union dirkey k;
 
   if (dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if (de.inum == 0)
-      continue;
-    if (namecmp(name, de.name) == 0) {
-      // entry matches path element
-      if (poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if (dcache_lookup(dp->dev, dp->inum, name, &inum, &off)) {
+    fsstats.ndchit++;
+    if (inum == 0)
+      return 0;
+    if (poff)
+      *poff = off;
+    return iget(dp->dev, inum);
   }
 
-  return 0;
+  dirkey(&k, name);
+  inum = 0;
+  if ((dp->flags & I_HASHDIR) && namecmp(name, ".") != 0 &&
+      namecmp(name, "..") != 0) {
+    inum = htlookup(dp, name, &k, &off);
+  } else {
+    // a hashed directory has only "." and ".." in block 0.
+    end = (dp->flags & I_HASHDIR) ? BSIZE : dp->size;
+    if ((off = dirscan(dp, 0, end, &k, &inum)) == end)
+      inum = 0;
+  }
+
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
+  if (inum == 0)
+    return 0;
+  if (poff)
+    *poff = off;
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int dirlink(struct inode *dp, char *name, uint inum) {
-  int off;
+  uint off;
   struct dirent de;
   struct inode *ip;
 
@@ -550,22 +1698,49 @@ int dirlink(struct inode *dp, char *name, uint inum) {
     return -1;
   }
 
+  if (dp->flags & I_HASHDIR)
+    return htlink(dp, name, inum);
+
   // Look for an empty dirent.
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if (de.inum == 0)
-      break;
+  off = dirscan(dp, 0, dp->size, 0, 0);
+
+  // a directory that has filled its first block gets an index.
+  if (off == BSIZE && dp->size == BSIZE) {
+    if (htconvert(dp) < 0)
+      return -1;
+    return htlink(dp, name, inum);
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
 
+// Is the directory dp empty except for "." and ".." ?
+// The table and leaf headers of a hashed directory have
+// inum 0, so they look like free dirents here.
+int isdirempty(struct inode *dp) {
+  struct buf *bp;
+  struct dirent *de;
+  uint off, n, i;
+
+  for (off = 2 * sizeof(*de); off < dp->size; off += n * sizeof(*de)) {
+    bp = dirblock(dp, off / BSIZE);
+    de = (struct dirent *)(bp->data + off % BSIZE);
+    n = min(dp->size - off, BSIZE - off % BSIZE) / sizeof(*de);
+    for (i = 0; i < n && de[i].inum == 0; i++)
+      ;
+    brelse(bp);
+    if (i < n)
+      return 0;
+  }
+  return 1;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
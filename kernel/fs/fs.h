@@ -10,6 +10,11 @@
 // Disk layout:
 // [ boot block | super block | log | inode blocks | free bit map | data blocks]
 //
+// The super block is always at byte SBOFFSET of the disk, so it can
+// be read before the block size is known. With blocks larger than
+// BSIZEMIN it shares block 0 with the boot block, and the log starts
+// at block 1.
+//
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
 struct superblock {
@@ -21,19 +26,55 @@ struct superblock {
   uint logstart;   // 第一个日志块的块号
   uint inodestart; // 第一个 inode 块的块号
   uint bmapstart;  // 第一个位图块的块号
+  uint bsize;      // 块大小 (bytes); 0 on older images, meaning BSIZEMIN
 };
 
 #define FSMAGIC 0x10203040
-#define BSIZE 1024                       // 块大小：1KB
-#define NDIRECT 12                       // 直接块数量 12
-#define NINDIRECT (BSIZE / sizeof(uint)) // 间接块大小 256
-#define MAXFILE (NDIRECT + NINDIRECT)    // 最大文件大小：(12 + 256) * 1KB
+#define SBOFFSET 1024 // byte offset of the super block
+#define BSIZEMIN 1024 // 块大小：1KB, 4KB or 8KB, from the super block
+#define BSIZEMAX 8192
+extern uint fsbsize;
+#define BSIZE fsbsize                    // 块大小 of the mounted file system
+#define NDIRECT 9                        // 直接块数量 9
+#define NINDIRECT (BSIZE / sizeof(uint)) // 间接块大小 256 (1KB blocks)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)  // 二级间接块映射 65536
+#define NTINDIRECT (NDINDIRECT * NINDIRECT) // 三级间接块映射 16M
+#define MAXFILE                                                                \
+  ((uint64)NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT) // 块数, ~16GB
 
 // File types
 #define T_DIR 1    // Directory
 #define T_FILE 2   // File
 #define T_DEVICE 3 // Device
 
+// Inode flags
+#define I_EXTENTS 0x1 // content is mapped by extents, not addrs[]
+#define I_HASHDIR 0x2 // directory with a hash index, see below
+#define I_INLINE 0x4  // file's bytes are in addrs[] itself, no blocks
+
+// An extent: len consecutive disk blocks starting at start.
+// A file's extents cover its blocks in order, with no holes,
+// so an extent's first logical block is the sum of the
+// lengths before it. len == 0 ends the list.
+struct extent {
+  uint start; // 起始块号
+  uint len;   // 连续块数量
+};
+
+#define NIEXTENT 5                              // extents in the inode
+#define NXEXTENT (BSIZE / sizeof(struct extent)) // extents per extent block
+#define NEXTENT (NIEXTENT + NINDIRECT * NXEXTENT) // extents per file
+
+// Extent map kept in place of addrs[] when I_EXTENTS is set.
+// Past the first NIEXTENT, extents are in extent blocks, which
+// the index block blk lists in order, up to NINDIRECT of them,
+// each full before the next is used.
+struct iextents {
+  struct extent e[NIEXTENT]; // the first extents
+  uint blk;                  // 索引块 listing the extent blocks, or 0
+  uint pad;
+};
+
 // On-disk inode structure 磁盘 Inode(dinode)
 struct dinode {
   short type;  // 文件类型 0=空闲, T_DIR=目录, T_FILE=文件, T_DEVICE=设备
@@ -41,13 +82,24 @@ struct dinode {
   short minor; // 次设备号（仅设备文件）
   short nlink; // 硬链接计数
   uint size;   // 文件大小（字节）
-  uint addrs[NDIRECT + 1]; // 数据块地址数组
+  uint flags;  // I_EXTENTS 等标志
+  union {
+    uint addrs[NDIRECT + 3]; // 数据块地址数组
+    struct iextents ext;     // 区段映射 (I_EXTENTS)
+  };
   /*
-    addrs[0..11]  → 直接块 (12 个)
-    addrs[12]     → 间接块指针 → 指向包含 256 个块地址的块
+    addrs[0..8]   → 直接块 (9 个)
+    addrs[9]      → 间接块指针 → 指向包含 256 个块地址的块
+    addrs[10]     → 二级间接块 → 256 个间接块
+    addrs[11]     → 三级间接块 → 256 个二级间接块
   */
 };
 
+// Bytes of a file kept in the inode (I_INLINE), in place of its
+// block map. Only regular files: a directory's "." and ".."
+// alone would not fit.
+#define NINLINE sizeof(((struct dinode *)0)->addrs)
+
 // Inodes per block.
 #define IPB (BSIZE / sizeof(struct dinode))
 
@@ -61,13 +113,52 @@ struct dinode {
 #define BBLOCK(b, sb) ((b) / BPB + sb.bmapstart)
 
 // Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+#define DIRSIZ 28
 
 // The name field may have DIRSIZ characters and not end in a NUL character.
 // 目录项
 struct dirent {
-  ushort inum;                                  // inode 编号 0表示空闲
+  uint inum;                                    // inode 编号 0表示空闲
   char name[DIRSIZ] __attribute__((nonstring)); // 文件名 最多DIRSIZ个字符
 };
 
+// Dirents per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A directory starts as one block of dirents. When that fills
+// up it becomes a hashed directory (I_HASHDIR): block 0 keeps
+// "." and "..", blocks 1..HTBLOCKS hold a table mapping the low
+// bits of a name's hash to the leaf block holding the name
+// (extendible hashing), and the leaf blocks after them hold
+// dirents. Table blocks and the first slot of each leaf are
+// made of htslots, whose inum is 0, so code that reads a
+// directory as a plain array of dirents sees them as free. mkfs
+// makes a root directory of more than one block hashed from the
+// start, so a linear directory is never more than one block.
+#define HTBLOCKS 4
+#define HTPERSLOT ((sizeof(struct dirent) - sizeof(uint)) / sizeof(ushort))
+#define HTMAGIC 0x4854
+
+struct htslot {
+  uint inum;              // always 0
+  ushort v[HTPERSLOT];    // table: leaf block of each hash value
+};
+
+// Slot 0 of table block 1 is the header: v[0] is HTMAGIC and
+// v[1] the number of hash bits the table uses. Slot 0 of a leaf
+// has v[0] HTMAGIC and v[1] the number of bits its names share.
+// The table entries follow the header.
+#define HTNPTR (HTBLOCKS * DPB * HTPERSLOT - HTPERSLOT)
+#define HTMAXDEPTH 10 // 1 << HTMAXDEPTH <= HTNPTR
+
+// Blocks a dirlink() may write on top of what a create in a
+// linear directory does: converting it (HTBLOCKS + 1 new blocks,
+// two bitmap blocks, an index block, block 0 and the inode) or
+// splitting a leaf up to HTMAXDEPTH times (the table, the old
+// leaf, a new leaf and its bitmap block per split, up to three
+// index blocks, and the inode).
+// Operations that may add a name reserve LINKOPBLOCKS.
+#define HTOPBLOCKS (HTBLOCKS + 5 + 2 * HTMAXDEPTH)
+#define LINKOPBLOCKS (MAXOPBLOCKS + HTOPBLOCKS)
+
 #endif // FS_H
\ No newline at end of file
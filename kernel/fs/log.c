@@ -1,8 +1,10 @@
 #include "../fs/buf.h"
 #include "../fs/fs.h"
+#include "../fs/log.h"
 #include "../include/defs.h"
 #include "../include/param.h"
 #include "../include/riscv.h"
+#include "../proc/proc.h"
 #include "../sync/sleeplock.h"
 #include "../sync/spinlock.h"
 
@@ -15,148 +17,415 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end, telling begin_op() how many blocks it
+// may write. Usually begin_op() just reserves that much of
+// the transaction and returns. But if the transaction is
+// close to running out of room, it sleeps until the current
+// transaction has been committed.
+//
+// Commits are done by a dedicated kernel thread (log_thread),
+// not by the last end_op(). This is group commit: when the
+// transaction goes idle the thread gives other runnable
+// processes a chance to join it before closing it, so one
+// set of log writes covers many system calls. end_op() sleeps
+// until the transaction it took part in is durable, which it
+// learns from the commit sequence number.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+//   header block, containing the tail of the log area
+//   log area, a circular buffer of committed transactions:
+//     descriptor blocks, containing block #s for block A, B, C, ...
+//     block A
+//     block B
+//     block C
+//     ...
+//     descriptor blocks of the next transaction ...
+// The size of the log comes from the superblock. The largest
+// transaction is what fits in half of the log area, so that
+// committing never has to wait for a checkpoint, and in a
+// third of the buffer cache, since its blocks stay pinned.
+// Log appends are synchronous, but all the blocks of a
+// transaction go to the log in multi-block disk requests.
+//
+// Every descriptor carries the transaction's sequence number and
+// a CRC32C of itself and of each logged block, so a transaction
+// is committed as soon as all of its blocks are in the log area:
+// recovery replays transactions from the tail for as long as they
+// are intact and in sequence, and stops at the first one that is
+// torn or left over from an earlier pass around the log.
+//
+// Committing a transaction only appends it to the log area and
+// advances the head. Installing the blocks at their home locations
+// (checkpointing) is deferred: committed blocks stay dirty and
+// pinned in the cache (bdirty()), a block rewritten by later
+// transactions is installed only once, and the tail moves up to
+// the head after all of them are home. Checkpoints are taken by
+// the log thread when the log area or the cache is running out of
+// room, and by a background thread once the log has been idle for
+// a while. In between, the flusher (fs.c) writes blocks that have
+// been dirty for a while home early, so that a checkpoint, which
+// holds up new transactions, has less left to write.
+
+// In memory, keeps track of logged block# before commit.
 struct logheader {
-  int n;                // 日志中的块数量
-  int block[LOGBLOCKS]; // 每个日志块对应的磁盘块号
+  int n;      // 日志中的块数量
+  int *block; // 每个日志块对应的磁盘块号
+  uint *crc;  // checksums of the blocks, filled in by commit
 };
 
 struct log {
   struct spinlock lock;
   int start;           // 日志在磁盘上的起始块号
+  int size;            // 环形日志区的块数量
+  int max;             // 事务的最大块数量
   int outstanding;     // 正在执行的文件系统调用数量
-  int committing;      // 是否正在提交日志 1 表示正在提交
+  int reserved;        // blocks reserved by outstanding operations
+  int txops;           // operations in the open transaction
+  int committing;      // 是否正在提交日志或写回 1 表示正在进行
   int dev;             // 设备号
+  uint64 seq;          // sequence number of the open transaction,
+                       // also the one it gets in the log
+  uint64 committed;    // last sequence number known to be on disk
+  uint head;           // next free position in the log area
+  uint tail;           // first position not yet installed
   struct logheader lh; // 内存中的日志头
+  struct buf descbuf;  // descriptor block, never in the buffer cache
+  struct buf scratch;  // log block being checked by recovery
+  struct logstat stat;
 };
 struct log logbuf;
 
+// blocks handed to the disk in one multi-block log write.
+#define LOGIOBLOCKS 16
+// ticks without a commit before the background checkpoint.
+#define CKPTTICKS 2
+
+extern struct spinlock tickslock;
+extern uint ticks;
+
 static void recover_from_log(void);
 static void commit(void);
+static void checkpoint(void);
+static void log_thread(void);
+static void checkpoint_thread(void);
 
 void initlog(int dev, struct superblock *sb) {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  if (sizeof(struct logdesc) > BSIZE)
+    panic("initlog: too big logdesc");
+  if (sizeof(struct loghead) > BSIZE)
+    panic("initlog: too big loghead");
 
   initlock(&logbuf.lock, "log");
+  initsleeplock(&logbuf.descbuf.lock, "logdesc");
+  initsleeplock(&logbuf.scratch.lock, "logscratch");
   logbuf.start = sb->logstart;
+  logbuf.size = sb->nlog - 1;
+
+  // size the largest transaction, descriptors included.
+  int max = logbuf.size / 2;
+  while (max > 0 && max + LOGDESCS(max) > logbuf.size / 2)
+    max--;
+  if (max > NBUF / 3)
+    max = NBUF / 3;
+  if (max > PAGESIZE / (2 * sizeof(int)))
+    max = PAGESIZE / (2 * sizeof(int));
+  if (max < LINKOPBLOCKS)
+    panic("initlog: log too small");
+  logbuf.max = max;
+  if ((logbuf.lh.block = alloc_page()) == 0 ||
+      (logbuf.lh.crc = alloc_page()) == 0)
+    panic("initlog: alloc_page");
+  // BSIZE bytes each, like the buffer cache's (bio.c).
+  int npg = (BSIZE + PAGESIZE - 1) / PAGESIZE;
+  if ((logbuf.descbuf.data = alloc_pages(npg)) == 0 ||
+      (logbuf.scratch.data = alloc_pages(npg)) == 0)
+    panic("initlog: alloc_pages");
   logbuf.dev = dev;
+  logbuf.descbuf.dev = dev;
+  logbuf.scratch.dev = dev;
   recover_from_log(); // 进行崩溃恢复
-}
 
-// Copy committed blocks from log to their home location
-static void install_trans(int recovering) {
-  int tail;
+  if (kthread_create(log_thread) < 0)
+    panic("initlog: log thread");
+  if (kthread_create(checkpoint_thread) < 0)
+    panic("initlog: checkpoint thread");
+}
 
-  for (tail = 0; tail < logbuf.lh.n; tail++) {
-    if (recovering) {
-      printf("recovering tail %d dst %d\n", tail, logbuf.lh.block[tail]);
-    }
-    struct buf *lbuf =
-        bread(logbuf.dev, logbuf.start + tail + 1); // read log block
-    struct buf *dbuf = bread(logbuf.dev, logbuf.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
-    bwrite(dbuf);                           // write dst to disk
-    if (recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+// Disk block holding position pos of the log area.
+static uint log_block(uint pos) {
+  return logbuf.start + 1 + pos % logbuf.size;
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk.
 static void read_head(void) {
   struct buf *buf = bread(logbuf.dev, logbuf.start);
-  struct logheader *lh = (struct logheader *)(buf->data);
-  int i;
-  logbuf.lh.n = lh->n;
-  for (i = 0; i < logbuf.lh.n; i++) {
-    logbuf.lh.block[i] = lh->block[i];
-  }
+  struct loghead *hb = (struct loghead *)(buf->data);
+  logbuf.tail = hb->tail;
+  logbuf.seq = hb->seq;
+  if (logbuf.seq == 0) // a new log; 0 is "nothing committed"
+    logbuf.seq = 1;
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the log tail to disk, freeing the log space before it.
+// Called by checkpoints, with logbuf.seq the sequence number
+// of the next transaction, which will go at the tail.
 static void write_head(void) {
   struct buf *buf = bread(logbuf.dev, logbuf.start);
-  struct logheader *hb = (struct logheader *)(buf->data);
-  int i;
-  hb->n = logbuf.lh.n;
-  for (i = 0; i < logbuf.lh.n; i++) {
-    hb->block[i] = logbuf.lh.block[i];
-  }
+  struct loghead *hb = (struct loghead *)(buf->data);
+  hb->tail = logbuf.tail;
+  hb->pad = 0;
+  hb->seq = logbuf.seq;
   bwrite(buf);
   brelse(buf);
+  logbuf.stat.nhead++;
+}
+
+// Checksum of a descriptor block, taken with its crc field zero.
+static uint desc_crc(struct logdesc *d) {
+  uint saved = d->crc;
+  uint crc;
+
+  d->crc = 0;
+  crc = crc32c(0, d, BSIZE);
+  d->crc = saved;
+  return crc;
+}
+
+// Read descriptor k of the transaction at pos into descbuf and
+// check that it belongs to transaction seq.
+static int read_desc(uint pos, int k, uint64 seq) {
+  struct buf *b = &logbuf.descbuf;
+  struct logdesc *d = (struct logdesc *)(b->data);
+
+  breadv(&b, 1, log_block(pos + k));
+  if (d->magic != LOGMAGIC || d->crc != desc_crc(d) || d->seq != seq ||
+      d->index != k)
+    return -1;
+  if (d->n <= 0 || d->n + LOGDESCS(d->n) > logbuf.size)
+    return -1;
+  return 0;
 }
 
+// Is the transaction seq at pos complete and intact?
+// Reads every descriptor and logged block and checks them.
+static int check_trans(uint pos, uint64 seq) {
+  struct buf *b = &logbuf.scratch;
+  struct logdesc *d = (struct logdesc *)(logbuf.descbuf.data);
+  uint data;
+  int i, n;
+
+  if (read_desc(pos, 0, seq) < 0)
+    return -1;
+  n = d->n;
+  data = pos + LOGDESCS(n);
+  for (i = 0; i < n; i++) {
+    if (i % LOGDPB == 0 && i > 0) {
+      if (read_desc(pos, i / LOGDPB, seq) < 0 || d->n != n)
+        return -1;
+    }
+    breadv(&b, 1, log_block(data + i));
+    if (crc32c(0, b->data, BSIZE) != d->block[i % LOGDPB].crc)
+      return -1;
+  }
+  return n;
+}
+
+// Replay the intact transactions from the tail on, oldest first,
+// so later copies of a block win. A transaction is checked in
+// full before any of it is installed, then its log blocks are
+// read again, straight into the home block's buffer with
+// breadv(), so the log area never enters the cache, where
+// write_log() would leave it stale.
 static void recover_from_log(void) {
+  struct logdesc *d = (struct logdesc *)(logbuf.descbuf.data);
+  uint pos, data;
+  int i, n;
+
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  logbuf.lh.n = 0;
-  write_head(); // clear the log
+  acquiresleep(&logbuf.descbuf.lock);
+  acquiresleep(&logbuf.scratch.lock);
+  for (pos = logbuf.tail; (n = check_trans(pos, logbuf.seq)) > 0;
+       pos = data + n) {
+    data = pos + LOGDESCS(n);
+    for (i = 0; i < n; i++) {
+      if (i % LOGDPB == 0)
+        read_desc(pos, i / LOGDPB, logbuf.seq);
+      int dst = d->block[i % LOGDPB].blockno;
+      printf("recovering pos %d dst %d\n", data + i, dst);
+      struct buf *dbuf = bread(logbuf.dev, dst);
+      breadv(&dbuf, 1, log_block(data + i)); // copy block to dst
+      bwrite(dbuf); // write dst to disk
+      logbuf.stat.ninstall++;
+      brelse(dbuf);
+    }
+    logbuf.seq++;
+  }
+  releasesleep(&logbuf.scratch.lock);
+  releasesleep(&logbuf.descbuf.lock);
+
+  // new transactions overwrite whatever follows the last intact one.
+  logbuf.head = pos;
+  logbuf.committed = logbuf.seq - 1;
+  if (logbuf.tail != logbuf.head) {
+    logbuf.tail = logbuf.head;
+    write_head(); // clear the log
+  }
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call, with the
+// most blocks the call may write, usually MAXOPBLOCKS.
 // 开始文件系统操作
-void begin_op(void) {
+void begin_op(int nblocks) {
+  struct proc *p = myproc();
+
+  if (nblocks > logbuf.max)
+    panic("begin_op: too big");
+
   acquire(&logbuf.lock);
   while (1) {
     if (logbuf.committing) {
       sleep(&logbuf, &logbuf.lock);
-    } else if (logbuf.lh.n + (logbuf.outstanding + 1) * MAXOPBLOCKS >
-               LOGBLOCKS) { // 防止日志空间不足
+    } else if (logbuf.lh.n + logbuf.reserved + nblocks >
+               logbuf.max) { // 防止日志空间不足
       // this op might exhaust log space; wait for commit.
       sleep(&logbuf, &logbuf.lock);
     } else {
       logbuf.outstanding += 1;
+      logbuf.reserved += nblocks;
+      logbuf.txops += 1;
+      p->logblocks = nblocks;
       release(&logbuf.lock);
       break;
     }
   }
 }
 
+// The most blocks one operation may write.
+int log_maxop(void) {
+  return logbuf.max;
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands the transaction to log_thread if this was the last
+// outstanding operation, then waits until it is committed.
 // 结束文件系统操作
 void end_op(void) {
-  int do_commit = 0;
+  uint64 seq;
 
   acquire(&logbuf.lock);
   logbuf.outstanding -= 1;
+  logbuf.reserved -= myproc()->logblocks;
+  myproc()->logblocks = 0;
+  logbuf.stat.nop++;
   if (logbuf.committing)
     panic("log.committing");
+  seq = logbuf.seq;
   if (logbuf.outstanding == 0) {
-    do_commit = 1;
-    logbuf.committing = 1;
+    // the transaction is idle; let the log thread decide
+    // whether to commit now or wait for more operations.
+    wakeup(&logbuf.outstanding);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing logbuf.outstanding has decreased
     // the amount of reserved space.
     wakeup(&logbuf);
   }
+
+  // an empty transaction has nothing to make durable.
+  while (logbuf.lh.n > 0 && logbuf.committed < seq)
+    sleep(&logbuf, &logbuf.lock);
   release(&logbuf.lock);
+}
+
+// The commit thread. Waits for the open transaction to go idle,
+// batches whatever else becomes ready, and commits it without
+// holding locks, since not allowed to sleep with locks.
+static void log_thread(void) {
+  uint64 seq;
+  int deferred = 0;
+
+  acquire(&logbuf.lock);
+  for (;;) {
+    if (logbuf.outstanding > 0 || logbuf.lh.n == 0) {
+      sleep(&logbuf.outstanding, &logbuf.lock);
+      continue;
+    }
+
+    // group commit: processes that are about to begin_op()
+    // get one chance to join before the transaction closes.
+    // a nearly full log is committed right away.
+    if (!deferred &&
+        logbuf.lh.n + MAXOPBLOCKS <= logbuf.max) {
+      deferred = 1;
+      release(&logbuf.lock);
+      yield();
+      acquire(&logbuf.lock);
+      continue;
+    }
+    deferred = 0;
+
+    logbuf.committing = 1;
+    seq = logbuf.seq;
+    if (logbuf.txops > logbuf.stat.maxtxops)
+      logbuf.stat.maxtxops = logbuf.txops;
+    logbuf.txops = 0;
+    release(&logbuf.lock);
 
-  if (do_commit) {
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
     commit();
+
+    acquire(&logbuf.lock);
+    logbuf.committed = seq;
+    logbuf.seq = seq + 1;
+    logbuf.stat.ncommit++;
+    wakeup(&logbuf); // the committers need not wait for a checkpoint
+
+    // make sure the next transaction fits in the log area, and
+    // keep enough of the cache unpinned for everyone else.
+    if (logbuf.size - (logbuf.head - logbuf.tail) <
+            logbuf.max + LOGDESCS(logbuf.max) ||
+        bndirty() >= logbuf.max) {
+      release(&logbuf.lock);
+      checkpoint();
+      acquire(&logbuf.lock);
+    }
+    logbuf.committing = 0;
+    wakeup(&logbuf);
+  }
+}
+
+// The background checkpoint thread. Once CKPTTICKS ticks pass
+// without a commit, installs whatever has been committed, so an
+// idle system does not keep blocks pinned and the log full.
+static void checkpoint_thread(void) {
+  uint64 seq;
+  uint ticks0;
+
+  for (;;) {
+    acquire(&logbuf.lock);
+    seq = logbuf.seq;
+    release(&logbuf.lock);
+
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while (ticks - ticks0 < CKPTTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    acquire(&logbuf.lock);
+    // an open transaction's blocks are in the cache too, so
+    // only install while no transaction is under way.
+    if (logbuf.seq != seq || logbuf.tail == logbuf.head ||
+        logbuf.committing || logbuf.outstanding > 0 || logbuf.lh.n > 0) {
+      release(&logbuf.lock);
+      continue;
+    }
+    logbuf.committing = 1;
+    release(&logbuf.lock);
+
+    checkpoint();
+
     acquire(&logbuf.lock);
     logbuf.committing = 0;
     wakeup(&logbuf);
@@ -164,30 +433,116 @@ void end_op(void) {
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write n buffers to the log area starting at position pos,
+// splitting the request where the area wraps around.
+static void write_area(struct buf **bs, int n, uint pos) {
+  int m;
+
+  while (n > 0) {
+    m = logbuf.size - pos % logbuf.size;
+    if (m > n)
+      m = n;
+    bwritev(bs, m, log_block(pos));
+    logbuf.stat.nlogwrite += m;
+    bs += m;
+    pos += m;
+    n -= m;
+  }
+}
+
+// Append the descriptors and the modified blocks to the log
+// area at the head, LOGIOBLOCKS blocks per disk request. The
+// blocks are pinned in the cache, so bread() finds them without
+// disk I/O, and the disk reads the cached data directly. Once
+// the last of these writes is done the transaction is committed.
 static void write_log(void) {
-  int tail;
-
-  for (tail = 0; tail < logbuf.lh.n; tail++) {
-    struct buf *to = bread(logbuf.dev, logbuf.start + tail + 1); // log block
-    struct buf *from = bread(logbuf.dev, logbuf.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to); // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *bs[LOGIOBLOCKS];
+  struct buf *desc = &logbuf.descbuf;
+  struct logdesc *d = (struct logdesc *)(desc->data);
+  int ndesc = LOGDESCS(logbuf.lh.n);
+  uint pos = logbuf.head;
+  int i, j, n, m;
+
+  // nothing can change the blocks until the commit is over.
+  for (i = 0; i < logbuf.lh.n; i++) {
+    struct buf *b = bread(logbuf.dev, logbuf.lh.block[i]); // cache block
+    logbuf.lh.crc[i] = crc32c(0, b->data, BSIZE);
+    brelse(b);
+  }
+
+  acquiresleep(&desc->lock);
+  for (i = 0; i < ndesc; i++) {
+    memset(d, 0, BSIZE);
+    d->magic = LOGMAGIC;
+    d->seq = logbuf.seq;
+    d->n = logbuf.lh.n;
+    d->index = i;
+    for (j = 0; j < LOGDPB && i * LOGDPB + j < logbuf.lh.n; j++) {
+      d->block[j].blockno = logbuf.lh.block[i * LOGDPB + j];
+      d->block[j].crc = logbuf.lh.crc[i * LOGDPB + j];
+    }
+    d->crc = desc_crc(d);
+    if (i < ndesc - 1)
+      write_area(&desc, 1, pos++);
+  }
+
+  // the last descriptor goes out with the first blocks.
+  bs[0] = desc;
+  m = 1;
+  for (i = 0; i < logbuf.lh.n; i += n) {
+    n = logbuf.lh.n - i;
+    if (n > LOGIOBLOCKS - m)
+      n = LOGIOBLOCKS - m;
+    for (j = 0; j < n; j++)
+      bs[m + j] = bread(logbuf.dev, logbuf.lh.block[i + j]); // cache block
+    write_area(bs, m + n, pos); // write the log
+    for (j = m; j < m + n; j++)
+      brelse(bs[j]);
+    pos += m + n;
+    m = 0;
   }
+  releasesleep(&desc->lock);
 }
 
+// Called with logbuf.committing set, so no operation adds to lh
+// while its blocks are written. begin_op() and the checkpoint
+// thread read lh.n and head under logbuf.lock, so they change
+// under it too.
 static void commit(void) {
+  int i;
+
   if (logbuf.lh.n > 0) {
-    write_log();      // Write modified blocks from cache to log
-    write_head();     // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+    write_log(); // Write modified blocks from cache to log -- the commit
+
+    // hand the blocks over to write-back.
+    for (i = 0; i < logbuf.lh.n; i++) {
+      struct buf *b = bread(logbuf.dev, logbuf.lh.block[i]);
+      bdirty(b);
+      brelse(b);
+    }
+    acquire(&logbuf.lock);
+    logbuf.head += LOGDESCS(logbuf.lh.n) + logbuf.lh.n;
     logbuf.lh.n = 0;
-    write_head(); // Erase the transaction from the log
+    release(&logbuf.lock);
   }
 }
 
+// Install every committed block still dirty at its home location
+// (see bflush()), then move the tail up to the head. Called with
+// logbuf.committing set, so no transaction is open.
+static void checkpoint(void) {
+  if (logbuf.tail == logbuf.head)
+    return;
+
+  logbuf.stat.ninstall += bflush(logbuf.dev, 0);
+  if (bndirty() > 0)
+    panic("checkpoint");
+
+  logbuf.tail = logbuf.head;
+  write_head(); // Free the log area
+  logbuf.stat.ncheckpoint++;
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
 // commit()/write_log() will do the disk write.
@@ -203,10 +558,12 @@ void log_write(struct buf *b) {
 
   acquire(&logbuf.lock);
   // 安全检查
-  if (logbuf.lh.n >= LOGBLOCKS)
+  if (logbuf.lh.n >= logbuf.max)
     panic("too big a transaction");
   if (logbuf.outstanding < 1)
     panic("log_write outside of trans");
+  logbuf.stat.nlogged++;
+  b->logged = 1;
 
   for (i = 0; i < logbuf.lh.n; i++) {
     if (logbuf.lh.block[i] == b->blockno) // log absorption
@@ -218,4 +575,11 @@ void log_write(struct buf *b) {
     logbuf.lh.n++;
   }
   release(&logbuf.lock);
+}
+
+// Copy the log statistics into *st.
+void logstat(struct logstat *st) {
+  acquire(&logbuf.lock);
+  *st = logbuf.stat;
+  release(&logbuf.lock);
 }
\ No newline at end of file
@@ -0,0 +1,49 @@
+// Write-ahead log: on-disk format, shared with fsck, and statistics
+#include "../include/types.h"
+
+#ifndef LOG_H
+#define LOG_H
+
+// Counters kept by log.c, for benchmarks and tests.
+struct logstat {
+  uint64 nop;         // FS operations completed (end_op calls)
+  uint64 ncommit;     // transactions committed
+  uint64 nlogwrite;   // blocks written to the on-disk log
+  uint64 ninstall;    // blocks copied to their home location
+  uint64 nhead;       // log header writes
+  uint64 nlogged;     // log_write calls, i.e. blocks modified by ops
+  uint64 ncheckpoint; // checkpoints taken
+  uint64 maxtxops;    // most operations in one transaction
+};
+
+// On-disk format; see log.c. BSIZE comes from fs.h.
+
+// Contents of a descriptor block. A transaction of n blocks
+// starts with LOGDESCS(n) of them; each repeats n and lists
+// the next LOGDPB block #s with their checksums.
+#define LOGMAGIC 0x10c0ffee
+#define LOGDPB ((BSIZE - 24) / 8)
+#define LOGDESCS(n) (((n) + LOGDPB - 1) / LOGDPB)
+struct logdesc {
+  uint magic;  // LOGMAGIC
+  uint crc;    // CRC32C of this block, computed with crc = 0
+  uint64 seq;  // 事务序号
+  int n;       // 事务中的块数量
+  int index;   // 这是事务的第几个描述块
+  struct {
+    int blockno; // 日志块对应的磁盘块号
+    uint crc;    // CRC32C of the logged contents
+  } block[];     // LOGDPB of them, to fill the block
+};
+
+// Contents of the header block, written only by checkpoints.
+// Positions in the log area count from mkfs time; position p
+// lives in block start + 1 + p % size. Transactions from the
+// tail on are committed but may not be installed yet.
+struct loghead {
+  uint tail;  // oldest transaction not yet installed
+  uint pad;
+  uint64 seq; // its sequence number
+};
+
+#endif // LOG_H
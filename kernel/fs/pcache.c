@@ -0,0 +1,414 @@
+// Page cache.
+//
+// Caches file contents a page (PAGESIZE bytes) at a time, keyed
+// on (dev, inum, page index), so that fileread() copies a page
+// straight to the user, or maps it there, instead of going
+// through bmap() and bread() for every block.
+//
+// A page's contents are protected by its inode's lock: pget()
+// fills a page, and pcache_write() and pcache_trunc() change
+// it, only with the inode locked. pcache.lock protects the
+// rest.
+//
+// A page's memory holds one reference (see page_dup()) for the
+// cache and one for each user page table that uvmshare() put it
+// in. Before the file changes under such a mapping, the cache
+// moves to a copy of the page, so that what read() returned
+// does not change.
+//
+// MAP_SHARED mappings of a file map its cached pages themselves
+// (pcache_map()), and a page so mapped is the file's data: it
+// stays in the cache, and takes write()s in place, until the
+// last such mapping goes (pcache_mapref()). read() copies from
+// it rather than share it.
+//
+// Delayed allocation: pcache_delay() writes past the blocks a
+// file has (ip->dsize) into its pages only, and marks them
+// dirty. A dirty page is the only copy of its data, so it
+// stays in the cache until iflush() has given the data blocks
+// and written it through the log; the flusher thread (fs.c)
+// does that once the writes have waited a while.
+
+#include "../fs/file.h"
+#include "../fs/fs.h"
+#include "../include/defs.h"
+#include "../include/param.h"
+#include "../include/riscv.h"
+#include "../include/types.h"
+#include "../proc/proc.h"
+#include "../sync/spinlock.h"
+
+extern uint ticks;
+
+// reads of at least this many bytes map whole pages into the
+// user's memory rather than copy them.
+#define PCMAPMIN (4 * PAGESIZE)
+
+// at most this many pages are dirty; writers past it write
+// their files out first (see filewrite()).
+#define PCDIRTY (NPCACHE / 2)
+
+// at most this many pages are mapped MAP_SHARED; faults past it
+// fail.
+#define PCMAPPED (NPCACHE / 4)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+struct page {
+  uint dev;
+  uint inum; // 0: not in use
+  uint pgno; // file offset / PAGESIZE
+  int ref;   // pget() callers holding it
+  int valid; // data has been read from the file
+  int dirty; // holds delayed writes
+  int nmap;  // MAP_SHARED page table entries mapping data
+  char *data;
+  struct page *hnext; // hash chain; 0-terminated
+  struct page *prev;  // LRU list, most recently used first
+  struct page *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCACHE];
+  struct page *hash[NPCACHE];
+  struct page head; // of the LRU list
+  int ndirty;
+  int nmapped; // pages with nmap > 0
+} pcache;
+
+static uint phash(uint dev, uint inum, uint pgno) {
+  return (inum * 31 + pgno + dev) % NPCACHE;
+}
+
+// Caller holds pcache.lock.
+static struct page *pfind(uint dev, uint inum, uint pgno) {
+  struct page *pg;
+
+  for (pg = pcache.hash[phash(dev, inum, pgno)]; pg; pg = pg->hnext) {
+    if (pg->inum == inum && pg->pgno == pgno && pg->dev == dev)
+      return pg;
+  }
+  return 0;
+}
+
+static void punhash(struct page *pg) {
+  struct page **pp;
+
+  for (pp = &pcache.hash[phash(pg->dev, pg->inum, pg->pgno)]; *pp;
+       pp = &(*pp)->hnext) {
+    if (*pp == pg) {
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->inum = 0;
+}
+
+void pcacheinit(void) {
+  struct page *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.head.next = pcache.head.prev = &pcache.head;
+  for (pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++) {
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+}
+
+// The cache's own copy of pg's memory, which a user mapping
+// shares; 0, leaving pg->data shared, if there is no memory
+// for one. A page mapped MAP_SHARED is always the cache's own.
+static char *punshare(struct page *pg) {
+  char *mem;
+
+  if (pg->nmap > 0 || page_refs(pg->data) == 1)
+    return pg->data;
+  if ((mem = alloc_page()) == 0)
+    return 0;
+  memmove(mem, pg->data, PAGESIZE);
+  free_page(pg->data);
+  return pg->data = mem;
+}
+
+static void pput(struct page *pg) {
+  acquire(&pcache.lock);
+  if (--pg->ref == 0) {
+    // most recently used
+    pg->next->prev = pg->prev;
+    pg->prev->next = pg->next;
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+  release(&pcache.lock);
+}
+
+// Page pgno of ip, read in if need be. Caller holds ip->lock.
+// Returns 0 if there is no memory for it.
+static struct page *pget(struct inode *ip, uint pgno) {
+  struct page *pg;
+  int n;
+
+  acquire(&pcache.lock);
+  if ((pg = pfind(ip->dev, ip->inum, pgno)) == 0) {
+    // recycle the least recently used clean page nobody holds.
+    for (pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev) {
+      if (pg->ref == 0 && !pg->dirty && pg->nmap == 0)
+        break;
+    }
+    if (pg == &pcache.head)
+      panic("pget: no pages");
+    if (pg->inum != 0)
+      punhash(pg);
+    pg->dev = ip->dev;
+    pg->inum = ip->inum;
+    pg->pgno = pgno;
+    pg->valid = 0;
+    pg->hnext = pcache.hash[phash(ip->dev, ip->inum, pgno)];
+    pcache.hash[phash(ip->dev, ip->inum, pgno)] = pg;
+  }
+  pg->ref++;
+  release(&pcache.lock);
+
+  if (!pg->valid) {
+    if (pg->data != 0 && punshare(pg) == 0) {
+      pput(pg);
+      return 0;
+    }
+    if (pg->data == 0 && (pg->data = alloc_page()) == 0) {
+      pput(pg);
+      return 0;
+    }
+    if ((n = readi(ip, 0, (uint64)pg->data, pgno * PAGESIZE, PAGESIZE)) < 0)
+      n = 0;
+    memset(pg->data + n, 0, PAGESIZE - n); // past the end of the file
+    pg->valid = 1;
+    fsstats.npfill++;
+  }
+  return pg;
+}
+
+// Page pgno of ip, for mmap(): its memory, with a reference
+// (see page_dup()) for the caller to drop with free_page(), or
+// 0 if there is no memory. Caller holds ip->lock.
+char *pcache_page(struct inode *ip, uint pgno) {
+  struct page *pg;
+  char *data;
+
+  if ((pg = pget(ip, pgno)) == 0)
+    return 0;
+  data = pg->data;
+  page_dup(data);
+  pput(pg);
+  return data;
+}
+
+// Page pgno of ip, for a MAP_SHARED mapping: pcache_page(), but
+// the page's memory itself, which stays the file's data until
+// the caller drops the mapping with pcache_mapref(). Returns 0
+// if there is no memory, or too many pages are mapped already.
+// Caller holds ip->lock.
+char *pcache_map(struct inode *ip, uint pgno) {
+  struct page *pg;
+  char *data;
+
+  if ((pg = pget(ip, pgno)) == 0)
+    return 0;
+  // read() buffers sharing the page keep what they read.
+  if (pg->nmap == 0 && (pcache.nmapped >= PCMAPPED || punshare(pg) == 0)) {
+    pput(pg);
+    return 0;
+  }
+  acquire(&pcache.lock);
+  if (pg->nmap++ == 0)
+    pcache.nmapped++;
+  data = pg->data;
+  page_dup(data);
+  release(&pcache.lock);
+  pput(pg);
+  return data;
+}
+
+// Add n (1 or -1) to the MAP_SHARED mappings of ip's page
+// pgno, which pcache_map() gave out: fork() copying one, or
+// munmap() removing one.
+void pcache_mapref(struct inode *ip, uint pgno, int n) {
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if ((pg = pfind(ip->dev, ip->inum, pgno)) == 0 || pg->nmap + n < 0)
+    panic("pcache_mapref");
+  if (pg->nmap == 0)
+    pcache.nmapped++;
+  if ((pg->nmap += n) == 0)
+    pcache.nmapped--;
+  release(&pcache.lock);
+}
+
+// readi() through the page cache. Whole pages of a large read
+// to a page-aligned user address below p->sz, in pages the
+// process may write, are mapped there read-only instead of
+// copied. Only regular files are cached: directory
+// blocks change under the hashed-directory code's log_write()s,
+// which do not keep pages up to date. Caller holds ip->lock.
+int pcache_read(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
+  struct page *pg;
+  uint tot, m;
+  int share;
+
+  if (ip->type != T_FILE)
+    return readi(ip, user_dst, dst, off, n);
+  if (off > ip->size || off + n < off)
+    return 0;
+  if (off + n > ip->size)
+    n = ip->size - off;
+  share = user_dst && n >= PCMAPMIN;
+
+  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    if ((pg = pget(ip, off / PAGESIZE)) == 0)
+      return tot + readi(ip, user_dst, dst, off, n - tot);
+    m = min(n - tot, PAGESIZE - off % PAGESIZE);
+    if (share && m == PAGESIZE && pg->nmap == 0 &&
+        dst + PAGESIZE <= myproc()->sz &&
+        uvmshare(myproc()->pagetable, dst, (uint64)pg->data) == 0) {
+      fsstats.npmap++;
+    } else if (either_copyout(user_dst, dst, pg->data + off % PAGESIZE, m)) {
+      pput(pg);
+      return -1;
+    }
+    pput(pg);
+  }
+  return tot;
+}
+
+// writei() wrote n bytes from src at off in ip, a block's worth
+// at most; bring the cached pages, if any, up to date.
+// Caller holds ip->lock.
+void pcache_write(struct inode *ip, uint off, char *src, uint n) {
+  struct page *pg;
+  uint m;
+
+  for (; n > 0; n -= m, off += m, src += m) {
+    m = min(n, PAGESIZE - off % PAGESIZE);
+    acquire(&pcache.lock);
+    if ((pg = pfind(ip->dev, ip->inum, off / PAGESIZE)) != 0)
+      pg->ref++;
+    release(&pcache.lock);
+    if (pg == 0)
+      continue;
+    if (pg->valid) {
+      // a dirty page must keep its data, even in a shared page.
+      if (punshare(pg) == 0 && !pg->dirty)
+        pg->valid = 0;
+      else
+        memmove(pg->data + off % PAGESIZE, src, m);
+    }
+    pput(pg);
+  }
+}
+
+// Forget ip's pages, and its delayed writes, for itrunc().
+// Caller holds ip->lock.
+void pcache_trunc(struct inode *ip) {
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for (pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++) {
+    if (pg->inum == ip->inum && pg->dev == ip->dev) {
+      pg->valid = 0;
+      if (pg->dirty) {
+        pg->dirty = 0;
+        pcache.ndirty--;
+      }
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Are so many pages dirty that writers should write out their
+// delayed writes rather than add to them?
+int pcache_busy(void) { return pcache.ndirty >= PCDIRTY; }
+
+// Write n bytes from src at off in ip to the page cache only,
+// and mark the pages dirty, for iflush() to allocate blocks for
+// later. off must be at or past ip->dsize. Stops short rather
+// than dirty more than PCDIRTY pages. Returns the number of
+// bytes written. Caller holds ip->lock.
+int pcache_delay(struct inode *ip, int user_src, uint64 src, uint off,
+                 uint n) {
+  struct page *pg;
+  uint tot, m;
+
+  if (off > ip->size || off < ip->dsize || off + n < off)
+    return 0;
+  if (!(ip->flags & I_EXTENTS) && (uint64)off + n > MAXFILE * BSIZE)
+    return 0;
+
+  for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    m = min(n - tot, PAGESIZE - off % PAGESIZE);
+    if ((pg = pget(ip, off / PAGESIZE)) == 0)
+      break;
+    // a dirty page must take the write, even in a shared page.
+    if ((!pg->dirty && pcache_busy()) || (punshare(pg) == 0 && !pg->dirty)) {
+      pput(pg);
+      break;
+    }
+    if (either_copyin(pg->data + off % PAGESIZE, user_src, src, m) == -1) {
+      if (!pg->dirty) // it may hold part of the write
+        pg->valid = 0;
+      pput(pg);
+      break;
+    }
+    acquire(&pcache.lock);
+    if (!pg->dirty) {
+      pg->dirty = 1;
+      pcache.ndirty++;
+    }
+    release(&pcache.lock);
+    pput(pg);
+    if (off + m > ip->size) {
+      if (ip->size == ip->dsize) { // the first delayed write
+        idup(ip);
+        ip->dticks = ticks;
+      }
+      ip->size = off + m;
+    }
+  }
+  return tot;
+}
+
+// The data of ip's dirty page pgno, for iflush(). Caller holds
+// ip->lock, which keeps the page, and its data, where they are.
+char *pcache_dirtypage(struct inode *ip, uint pgno) {
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  pg = pfind(ip->dev, ip->inum, pgno);
+  release(&pcache.lock);
+  if (pg == 0 || !pg->dirty)
+    panic("pcache_dirtypage");
+  return pg->data;
+}
+
+// iflush() wrote bytes [off, end) of ip to the disk. Pages
+// with nothing past end waiting are clean now. Caller holds
+// ip->lock.
+void pcache_clean(struct inode *ip, uint off, uint end) {
+  struct page *pg;
+  uint pgno;
+
+  acquire(&pcache.lock);
+  for (pgno = off / PAGESIZE; pgno * PAGESIZE < end; pgno++) {
+    if ((pgno + 1) * PAGESIZE > end && end < ip->size)
+      break;
+    if ((pg = pfind(ip->dev, ip->inum, pgno)) != 0 && pg->dirty) {
+      pg->dirty = 0;
+      pcache.ndirty--;
+    }
+  }
+  release(&pcache.lock);
+}
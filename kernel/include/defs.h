@@ -1,9 +1,13 @@
 #include "../include/types.h"
 
+struct bstat;
 struct buf;
 struct context;
 struct file;
+struct fsstat;
 struct inode;
+struct iovec;
+struct logstat;
 struct pipe;
 struct proc;
 struct sleeplock;
@@ -27,6 +31,9 @@ void print_ptr(uint64 x);
 int printf(const char *fmt, ...);
 void panic(char *) __attribute__((noreturn));
 
+// crc.c
+uint crc32c(uint, const void *, uint);
+
 // string.c
 void *memset(void *dst, int c, uint n);
 int memcmp(const void *, const void *, uint);
@@ -45,6 +52,8 @@ void free_page(void *pa);
 void free_page_to_freelist(void *pa);
 void *alloc_page(void);
 void *alloc_pages(int n);
+void page_dup(void *pa);
+int page_refs(void *pa);
 
 // vm.c
 pagetable_t create_pagetable(void);
@@ -71,8 +80,20 @@ uint64 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int perm);
 uint64 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz);
 int uvmcopy(pagetable_t from, pagetable_t to, uint64 sz);
 int ismapped(pagetable_t pagetable, uint64 va);
+int iscow(pagetable_t pagetable, uint64 va);
+int uvmshare(pagetable_t pagetable, uint64 va, uint64 pa);
+int uvmcow(pagetable_t pagetable, uint64 va);
 uint64 vmfault(pagetable_t pagetable, uint64 va, int write);
 
+// mmap.c
+uint64 mmapbase(struct proc *);
+uint64 mmap(uint64, uint64, int, int, struct file *, uint);
+int munmap(uint64, uint64);
+void munmapall(struct proc *);
+int mmapcopy(struct proc *, struct proc *);
+uint64 mmapfault(struct proc *, uint64, int);
+int mmapprefault(struct proc *, uint64, uint64, int);
+
 // trap.c
 void trapinit(void);
 void trapinithart(void);
@@ -158,22 +179,55 @@ int holdingsleep(struct sleeplock *);
 
 // bio.c
 void binit(void);
+void bresize(uint);
 struct buf *bread(uint, uint);
+struct buf *bread_data(uint, uint);
+struct buf *bnew(uint, uint, int);
 void brelse(struct buf *);
 void bwrite(struct buf *);
+void bwritev(struct buf **, int, uint);
+void breadv(struct buf **, int, uint);
 void bpin(struct buf *);
 void bunpin(struct buf *);
+void bdirty(struct buf *);
+int bndirty(void);
+int bflush(uint, uint);
+int bsync(uint, uint *, int);
+int flush_all_blocks(uint);
+void bstat(struct bstat *);
+int bpolicy(int);
 
 // log.c
 void initlog(int, struct superblock *);
 void log_write(struct buf *);
-void begin_op(void);
+void begin_op(int);
+int log_maxop(void);
 void end_op(void);
+void logstat(struct logstat *);
+
+// dcache.c
+void dcacheinit(void);
+int dcache_lookup(uint, uint, char *, uint *, uint *);
+void dcache_enter(uint, uint, char *, uint, uint);
+void dcache_purge(uint, uint);
+
+// pcache.c
+void pcacheinit(void);
+int pcache_read(struct inode *, int, uint64, uint, uint);
+char *pcache_page(struct inode *, uint);
+char *pcache_map(struct inode *, uint);
+void pcache_mapref(struct inode *, uint, int);
+void pcache_write(struct inode *, uint, char *, uint);
+void pcache_trunc(struct inode *);
+int pcache_delay(struct inode *, int, uint64, uint, uint);
+int pcache_busy(void);
+char *pcache_dirtypage(struct inode *, uint);
+void pcache_clean(struct inode *, uint, uint);
 
 // fs.c
 void fsinit(int);
 void iinit(void);
-struct inode *ialloc(uint, short);
+struct inode *ialloc(uint, short, uint);
 struct inode *idup(struct inode *);
 void ilock(struct inode *);
 void iunlock(struct inode *);
@@ -184,7 +238,11 @@ void itrunc(struct inode *);
 void stati(struct inode *, struct stat *);
 int readi(struct inode *, int, uint64, uint, uint);
 int writei(struct inode *, int, uint64, uint, uint);
+void iflush(struct inode *);
+int isync(struct inode *);
 int namecmp(const char *, const char *);
+int isdirempty(struct inode *);
+void fsstat(struct fsstat *);
 struct inode *dirlookup(struct inode *, char *, uint *);
 int dirlink(struct inode *, char *, uint);
 struct inode *namei(char *);
@@ -198,17 +256,23 @@ void fileclose(struct file *);
 int filestat(struct file *, uint64);
 int fileread(struct file *, uint64, int);
 int filewrite(struct file *, uint64, int);
+int filereadv(struct file *, struct iovec *, int, uint *);
+int filewritev(struct file *, struct iovec *, int, uint *);
+int filesend(struct file *, struct file *, uint *, int);
+int filesync(struct file *);
 
 // virtio_disk.c
 void virtio_disk_init(void);
 void virtio_disk_rw(struct buf *, int);
+void virtio_disk_rwv(struct buf **, int, uint, int);
 void virtio_disk_intr(void);
+void virtio_disk_crash(int);
 
 // pipe.c - Inter-Process Communication (kernel/ipc/)
 int pipealloc(struct file **, struct file **);
 void pipeclose(struct pipe *, int);
-int piperead(struct pipe *, uint64, int);
-int pipewrite(struct pipe *, uint64, int);
+int piperead(struct pipe *, int, uint64, int);
+int pipewrite(struct pipe *, int, uint64, int);
 
 // TEST
 // lab2.c
@@ -228,3 +292,26 @@ void test_exception_handling(void);
 void test_process_creation(void);
 void test_scheduler(void);
 void test_synchronization(void);
+// lab6.c
+void test_filesystem(void);
+void test_group_commit(void);
+void test_log_concurrency(void);
+void test_checkpoint(void);
+void test_large_file(void);
+void test_bsize(void);
+void test_pcache(void);
+void test_delalloc(void);
+void test_writeback(void);
+void test_bcache(void);
+void test_mmap(void);
+void test_indirect(void);
+void test_balloc(void);
+void test_ialloc(void);
+void test_iget(void);
+void test_dcache(void);
+void test_bigdir(void);
+void test_dirscan(void);
+void test_inline(void);
+void test_writev(void);
+void test_sendfile(void);
+void test_log_crash(void);
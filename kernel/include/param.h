@@ -1,15 +1,19 @@
 #define NPROC 16                    // maximum number of processes
 #define NCPU 1                      // maximum number of CPUs
 #define NOFILE 16                   // open files per process
+#define NIOV 16                     // segments per readv() or writev()
+#define NVMA 16                     // mmap() regions per process
 #define NFILE 100                   // open files per system
-#define NINODE 50                   // maximum number of active i-nodes
+#define NINODE 50                   // minimum number of in-memory i-nodes
 #define NDEV 10                     // maximum major device number
 #define ROOTDEV 1                   // device number of file system root disk
 #define MAXARG 32                   // max exec arguments
 #define MAXOPBLOCKS 10              // max # of blocks any FS op writes
-#define LOGBLOCKS (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)      // size of disk block cache
-#define FSSIZE 2000                 // size of file system in blocks
+#define LOGSIZE 241                 // default blocks in on-disk log, for mkfs
+#define NBUF (MAXOPBLOCKS * 30)     // size of disk block cache
+#define NDCACHE 256                 // directory name cache entries
+#define NPCACHE 512                 // page cache pages
+#define FSSIZE 40000                // size of file system in blocks
 #define MAXPATH 128                 // maximum file path name
 #define USERSTACK 1                 // user stack pages
 #define PAGE_POOL_CAP 16            // 页面池容量
\ No newline at end of file
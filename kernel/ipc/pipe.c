@@ -11,6 +11,8 @@
 #include "../proc/proc.h"
 #include "../sync/sleeplock.h"
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 int pipealloc(struct file **f0, struct file **f1) {
   struct pipe *pi;
 
@@ -61,10 +63,15 @@ void pipeclose(struct pipe *pi, int writable) {
     release(&pi->lock);
 }
 
-int pipewrite(struct pipe *pi, uint64 addr, int n) {
-  int i = 0;
+// Write n bytes from src, a user virtual address if user_src,
+// else a kernel address, to pi, as many at a time as fit.
+int pipewrite(struct pipe *pi, int user_src, uint64 src, int n) {
+  int i = 0, m;
   struct proc *pr = myproc();
 
+  // copyin() must not fault in an mmap()ed page under pi->lock.
+  if (user_src && mmapprefault(pr, src, n, 0) < 0)
+    return -1;
   acquire(&pi->lock);
   while (i < n) {
     if (pi->readopen == 0 || killed(pr)) {
@@ -75,11 +82,14 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if (copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // up to the free space, or the end of data[].
+      m = min(n - i, pi->nread + PIPESIZE - pi->nwrite);
+      m = min(m, PIPESIZE - pi->nwrite % PIPESIZE);
+      if (either_copyin(&pi->data[pi->nwrite % PIPESIZE], user_src, src + i,
+                        m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -88,11 +98,15 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
   return i;
 }
 
-int piperead(struct pipe *pi, uint64 addr, int n) {
-  int i;
+// Read up to n bytes from pi to dst, a user virtual address if
+// user_dst, else a kernel address.
+int piperead(struct pipe *pi, int user_dst, uint64 dst, int n) {
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
 
+  // nor copyout(); one read takes at most PIPESIZE bytes.
+  if (user_dst && mmapprefault(pr, dst, min(n, PIPESIZE), 1) < 0)
+    return -1;
   acquire(&pi->lock);
   while (pi->nread == pi->nwrite && pi->writeopen) { // DOC: pipe-empty
     if (killed(pr)) {
@@ -101,12 +115,13 @@ int piperead(struct pipe *pi, uint64 addr, int n) {
     }
     sleep(&pi->nread, &pi->lock); // DOC: piperead-sleep
   }
-  for (i = 0; i < n; i++) { // DOC: piperead-copy
-    if (pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if (copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for (i = 0; i < n && pi->nread != pi->nwrite; i += m) { // DOC: piperead-copy
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - pi->nread % PIPESIZE);
+    if (either_copyout(user_dst, dst + i, &pi->data[pi->nread % PIPESIZE],
+                       m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite); // DOC: piperead-wakeup
   release(&pi->lock);
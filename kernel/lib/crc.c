@@ -0,0 +1,30 @@
+#include "../include/types.h"
+
+// CRC-32C (Castagnoli), the checksum used by ext4 and iSCSI.
+// Table driven, one byte per step; the table is built on first use.
+
+#define CRC32C_POLY 0x82f63b78 // reversed 0x1edc6f41
+
+static uint crc32c_table[256];
+
+static void crc32c_init(void) {
+  for (uint i = 0; i < 256; i++) {
+    uint c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[i] = c;
+  }
+}
+
+// Extend crc over n bytes at p. Start with crc = 0;
+// crc32c(0, "123456789", 9) is 0xe3069283.
+uint crc32c(uint crc, const void *p, uint n) {
+  const uchar *s = p;
+
+  if (crc32c_table[1] == 0)
+    crc32c_init();
+  crc = ~crc;
+  while (n-- > 0)
+    crc = crc32c_table[(crc ^ *s++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
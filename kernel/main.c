@@ -45,7 +45,15 @@ void run_lab(int lab) {
   
   // Lab6
   case 6:
-    
+    pt_init();
+    procinit();
+    trapinit();
+    trapinithart();
+    plicinit();
+    plicinithart();
+    test_filesystem();
+    break;
+
   default:
     uart_puts("No such lab!");
     break;
@@ -53,6 +61,6 @@ void run_lab(int lab) {
 }
 
 int main() {
-  int lab = 5;
+  int lab = 6;
   run_lab(lab);
 }
\ No newline at end of file
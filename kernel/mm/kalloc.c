@@ -27,11 +27,48 @@ struct {
   int n;
 } page_cache;
 
+// References to each page: one for whoever allocated it, and
+// one more for each extra page table entry that maps it (see
+// page_dup()). free_page() drops one, and frees the page when
+// the last one goes.
+#define PGREF(pa) (((uint64)(pa) - KERNBASE) / PAGESIZE)
+
+struct {
+  struct spinlock lock;
+  ushort n[(PHYSTOP - KERNBASE) / PAGESIZE];
+} pgref;
+
 static int initialized = 0;
 
+static void pgref_set(void *pa, int n) {
+  acquire(&pgref.lock);
+  pgref.n[PGREF(pa)] = n;
+  release(&pgref.lock);
+}
+
+// Take another reference to the allocated page pa.
+void page_dup(void *pa) {
+  acquire(&pgref.lock);
+  if (pgref.n[PGREF(pa)] == 0)
+    panic("page_dup: free page");
+  pgref.n[PGREF(pa)]++;
+  release(&pgref.lock);
+}
+
+// Number of references to page pa.
+int page_refs(void *pa) {
+  int n;
+
+  acquire(&pgref.lock);
+  n = pgref.n[PGREF(pa)];
+  release(&pgref.lock);
+  return n;
+}
+
 void kmem_init() {
   initlock(&kmem.lock, "kmem");
   initlock(&page_cache.lock, "page_cache");
+  initlock(&pgref.lock, "pgref");
   page_cache.n = 0;
   initialized = 0;
   freerange(end, (void *)PHYSTOP);
@@ -55,6 +92,15 @@ void free_page(void *pa) {
   if (((uint64)pa % PAGESIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP)
     panic("free_page: invalid page");
 
+  acquire(&pgref.lock);
+  if (pgref.n[PGREF(pa)] > 1) {
+    pgref.n[PGREF(pa)]--;
+    release(&pgref.lock);
+    return;
+  }
+  pgref.n[PGREF(pa)] = 0;
+  release(&pgref.lock);
+
   // 跳过初始化阶段的 memset
   if (initialized) {
     memset(pa, 1, PAGESIZE);
@@ -100,6 +146,7 @@ void *alloc_page(void) {
   if (page_cache.n > 0) {
     void *p = page_cache.buf[--page_cache.n];
     release(&page_cache.lock);
+    pgref_set(p, 1);
     // 填充垃圾数据
     memset((char *)p, 5, PAGESIZE);
     return p;
@@ -113,9 +160,11 @@ void *alloc_page(void) {
   if (r)
     kmem.freelist = r->next;
   release(&kmem.lock);
-  if (r)
+  if (r) {
+    pgref_set(r, 1);
     // 填充垃圾数据
     memset((char *)r, 5, PAGESIZE);
+  }
   return (void *)r;
 }
 
@@ -173,6 +222,7 @@ void *alloc_pages(int n) {
 
       // 填充垃圾数据
       for (int i = 0; i < n; i++) {
+        pgref_set((char *)seg_start + i * PAGESIZE, 1);
         memset((void *)((char *)seg_start + i * PAGESIZE), 3, PAGESIZE);
       }
 
@@ -0,0 +1,357 @@
+// Memory-mapped files and anonymous memory.
+//
+// mmap() only records a vma in the process, at addresses that
+// grow down from TRAPFRAME. vmfault() fills the pages in as
+// they are touched:
+// * anonymous memory gets a zeroed page;
+// * a MAP_PRIVATE file page maps the page cache's page itself,
+//   read-only; if the vma is writable, the PTE has PTE_COW and
+//   the first write gets a copy (uvmcow());
+// * a MAP_SHARED file page maps the page cache's page too
+//   (pcache_map()), read-only at first. The first write makes
+//   it writable and sets PTE_DIRTY, and munmap() (or exit)
+//   writes the dirty pages back to the file through the log.
+//
+// All MAP_SHARED mappings of a file page, and read() and
+// write(), use the one page in the cache, so they see each
+// other's writes at once; the disk catches up at munmap().
+
+#include "../fs/fcntl.h"
+#include "../fs/file.h"
+#include "../fs/fs.h"
+#include "../include/defs.h"
+#include "../include/memlayout.h"
+#include "../include/param.h"
+#include "../include/riscv.h"
+#include "../include/types.h"
+#include "../proc/proc.h"
+
+// The vma of p that holds va, or 0.
+static struct vma *vmafind(struct proc *p, uint64 va) {
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end != 0 && va >= v->start && va < v->end)
+      return v;
+  }
+  return 0;
+}
+
+static int vmaperm(struct vma *v) {
+  int perm = PTE_U;
+
+  if (v->prot & PROT_READ)
+    perm |= PTE_R;
+  if (v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if (v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// The lowest address of p's mappings, or TRAPFRAME if it has
+// none: growproc() must keep p->sz below it.
+uint64 mmapbase(struct proc *p) {
+  struct vma *v;
+  uint64 top = TRAPFRAME;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end != 0 && v->start < top)
+      top = v->start;
+  }
+  return top;
+}
+
+// Map len bytes of f from offset off, or anonymous memory if
+// flags has MAP_ANONYMOUS, somewhere in the current process.
+// addr is only a hint, and ignored. Returns the address, or
+// -1.
+uint64 mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f,
+            uint off) {
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+  uint64 top = mmapbase(p);
+
+  len = PAGEROUNDUP(len);
+  if (len == 0 || off % PAGESIZE != 0 ||
+      ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if (flags & MAP_ANONYMOUS) {
+    f = 0;
+  } else {
+    if (f == 0 || f->type != FD_INODE || f->ip->type != T_FILE)
+      return -1;
+    if (!f->readable ||
+        ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable))
+      return -1;
+  }
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end == 0 && free == 0)
+      free = v;
+  }
+  if (free == 0 || top < p->sz + len)
+    return -1;
+
+  free->start = top - len;
+  free->end = top;
+  free->prot = prot;
+  free->flags = flags;
+  free->f = f ? filedup(f) : 0;
+  free->off = off;
+  return free->start;
+}
+
+// Write the page at va of shared file mapping v, the cache's
+// page, back to the file, in transactions the size filewrite()
+// uses. Only the part of the page inside the file is written;
+// a mapping does not grow its file.
+static void vmawrite(struct vma *v, uint64 va, uint64 pa) {
+  struct inode *ip = v->f->ip;
+  int max = ((log_maxop() - 1 - 1 - 2) / 2) * BSIZE;
+  uint off = v->off + (va - v->start);
+  uint i, n;
+
+  for (i = 0; i < PAGESIZE; i += max) {
+    n = PAGESIZE - i < max ? PAGESIZE - i : max;
+    begin_op((n / BSIZE) * 2 + 1 + 1 + 2);
+    ilock(ip);
+    if (off + i < ip->size) {
+      if (off + i + n > ip->size)
+        n = ip->size - off - i;
+      writei(ip, 0, pa + i, off + i, n);
+    }
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Unmap [start, end) of v, writing dirty shared pages back.
+static void vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end) {
+  pte_t *pte;
+  uint64 va;
+
+  for (va = start; va < end; va += PAGESIZE) {
+    if ((pte = walk_lookup(p->pagetable, va)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if (v->f == 0 || !(v->flags & MAP_SHARED)) {
+      unmap_page(p->pagetable, va, 1, 1);
+      continue;
+    }
+    // the page stays in the cache until it is written back.
+    if (*pte & PTE_DIRTY)
+      vmawrite(v, va, PTE2PA(*pte));
+    unmap_page(p->pagetable, va, 1, 1);
+    pcache_mapref(v->f->ip, (v->off + (va - v->start)) / PAGESIZE, -1);
+  }
+}
+
+// Remove p's mappings in [addr, addr + len), which must lie in
+// one vma. Returns 0, or -1.
+static int vmaremove(struct proc *p, uint64 addr, uint64 len) {
+  struct vma *v, *nv = 0;
+  uint64 end;
+
+  len = PAGEROUNDUP(len);
+  end = addr + len;
+  if (addr % PAGESIZE != 0 || len == 0 || (v = vmafind(p, addr)) == 0 ||
+      end > v->end)
+    return -1;
+  if (addr > v->start && end < v->end) {
+    // a hole in the middle: the part above it needs a vma.
+    for (nv = p->vma; nv < &p->vma[NVMA] && nv->end != 0; nv++)
+      ;
+    if (nv == &p->vma[NVMA])
+      return -1;
+  }
+
+  vmaunmap(p, v, addr, end);
+  if (nv) {
+    *nv = *v;
+    nv->start = end;
+    nv->off += end - v->start;
+    if (nv->f)
+      filedup(nv->f);
+    v->end = addr;
+  } else if (addr == v->start && end == v->end) {
+    if (v->f)
+      fileclose(v->f);
+    v->end = 0;
+  } else if (addr == v->start) {
+    v->off += len;
+    v->start = end;
+  } else {
+    v->end = addr;
+  }
+  return 0;
+}
+
+int munmap(uint64 addr, uint64 len) { return vmaremove(myproc(), addr, len); }
+
+// Remove all of p's mappings, for exit().
+void munmapall(struct proc *p) {
+  struct vma *v;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end != 0)
+      vmaremove(p, v->start, v->end - v->start);
+  }
+}
+
+// Give fork()'s child np copies of p's mappings. The child
+// maps the same pages: MAP_SHARED ones as they are, so parent
+// and child go on sharing them, and private ones copy-on-write
+// in both, as uvmcow() undoes. Returns 0, or -1 if out of
+// memory.
+int mmapcopy(struct proc *p, struct proc *np) {
+  struct vma *v;
+  pte_t *pte;
+  uint64 va, pa;
+  uint pgno;
+  int perm;
+
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end == 0)
+      continue;
+    for (va = v->start; va < v->end; va += PAGESIZE) {
+      if ((pte = walk_lookup(p->pagetable, va)) == 0 || (*pte & PTE_V) == 0) {
+        if (v->f || !(v->flags & MAP_SHARED))
+          continue;
+        // shared anonymous memory has no page to fault in from
+        // later: without one now, each would get its own.
+        if (mmapfault(p, va, 0) == 0)
+          goto bad;
+        pte = walk_lookup(p->pagetable, va);
+      }
+      pa = PTE2PA(*pte);
+      pgno = (v->off + (va - v->start)) / PAGESIZE;
+      if (!(v->flags & MAP_SHARED) && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      perm = PTE_FLAGS(*pte) & ~PTE_V;
+      page_dup((void *)pa);
+      if (map_page(np->pagetable, va, pa, PAGESIZE, perm) != 0) {
+        free_page((void *)pa);
+        goto bad;
+      }
+      if (v->f && (v->flags & MAP_SHARED))
+        pcache_mapref(v->f->ip, pgno, 1);
+    }
+  }
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    np->vma[v - p->vma] = *v;
+    if (v->end != 0 && v->f)
+      filedup(v->f);
+  }
+  return 0;
+
+bad:
+  // the pages mapped so far are above np->sz, where freeproc()
+  // does not look.
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    for (va = v->start; va < v->end; va += PAGESIZE) {
+      if ((pte = walk_lookup(np->pagetable, va)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      unmap_page(np->pagetable, va, 1, 1);
+      if (v->f && (v->flags & MAP_SHARED))
+        pcache_mapref(v->f->ip, (v->off + (va - v->start)) / PAGESIZE, -1);
+    }
+  }
+  return -1;
+}
+
+// vmfault() for an address above p->sz: fill in, or make
+// writable, the page at va if it is in a vma that allows the
+// access. Returns the page's physical address, or 0.
+uint64 mmapfault(struct proc *p, uint64 va, int write) {
+  struct vma *v;
+  struct inode *ip;
+  pte_t *pte;
+  char *mem, *pg;
+  uint pgno = 0;
+  int perm;
+
+  va = PAGEROUNDDOWN(va);
+  if ((v = vmafind(p, va)) == 0)
+    return 0;
+  if (!(v->prot & (write ? PROT_WRITE : PROT_READ)))
+    return 0;
+  perm = vmaperm(v);
+
+  if ((pte = walk_lookup(p->pagetable, va)) != 0 && (*pte & PTE_V)) {
+    // a shared file page's first write.
+    if (!write || !(v->flags & MAP_SHARED) || (*pte & PTE_W))
+      return 0;
+    *pte |= PTE_W | PTE_DIRTY;
+    return PTE2PA(*pte);
+  }
+
+  if (v->f == 0) {
+    if ((mem = alloc_page()) == 0)
+      return 0;
+    memset(mem, 0, PAGESIZE);
+  } else {
+    ip = v->f->ip;
+    pgno = (v->off + (va - v->start)) / PAGESIZE;
+    ilock(ip);
+    if (v->flags & MAP_SHARED)
+      pg = pcache_map(ip, pgno);
+    else
+      pg = pcache_page(ip, pgno);
+    iunlock(ip);
+    if (pg == 0)
+      return 0;
+    if (v->flags & MAP_SHARED) {
+      mem = pg;
+      if (write)
+        perm |= PTE_DIRTY;
+      else
+        perm &= ~PTE_W;
+    } else if (!write) {
+      mem = pg; // the cache's own page
+      if (perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+    } else {
+      if ((mem = alloc_page()) != 0)
+        memmove(mem, pg, PAGESIZE);
+      free_page(pg);
+      if (mem == 0)
+        return 0;
+    }
+  }
+  if (map_page(p->pagetable, va, (uint64)mem, PAGESIZE, perm) != 0) {
+    free_page(mem);
+    if (v->f && (v->flags & MAP_SHARED))
+      pcache_mapref(v->f->ip, pgno, -1);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Fault in the pages of p's mappings that [va, va + len)
+// overlaps, for writing if write. copyout() and copyin() fault
+// them in themselves, but mmapfault() locks the mapped inode
+// and may wait for the disk, which a copy made under a spinlock
+// or under that inode's lock must not do; such callers call
+// this first. Returns 0, or -1 if a page cannot be faulted in.
+int mmapprefault(struct proc *p, uint64 va, uint64 len, int write) {
+  struct vma *v;
+  pte_t *pte;
+  uint64 a, end;
+
+  if (va + len < va)
+    return -1;
+  for (v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->end == 0 || va + len <= v->start || va >= v->end)
+      continue;
+    a = va > v->start ? PAGEROUNDDOWN(va) : v->start;
+    end = va + len < v->end ? va + len : v->end;
+    for (; a < end; a += PAGESIZE) {
+      pte = walk_lookup(p->pagetable, a);
+      if (pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+        continue;
+      if (vmfault(p->pagetable, a, write) == 0)
+        return -1;
+    }
+  }
+  return 0;
+}
@@ -221,6 +221,15 @@ int copy_pagetable(pagetable_t old, pagetable_t new, uint64 sz) {
   return 0;
 }
 
+// Is va a user page the user may not write?
+static int isreadonly(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+
+  if (va >= MAXVA || (pte = walk_lookup(pagetable, va)) == 0)
+    return 0;
+  return (*pte & (PTE_V | PTE_U | PTE_W)) == (PTE_V | PTE_U);
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -230,6 +239,8 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
   while (len > 0) {
     va0 = PAGEROUNDDOWN(dstva);
     pa0 = walkaddr(pagetable, va0);
+    if (pa0 == 0 || isreadonly(pagetable, va0))
+      pa0 = vmfault(pagetable, va0, 1); // may copy it, or refuse
     if (pa0 == 0)
       return -1;
     n = PAGESIZE - (dstva - va0);
@@ -253,6 +264,8 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
   while (len > 0) {
     va0 = PAGEROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
+    if (pa0 == 0)
+      pa0 = vmfault(pagetable, va0, 0);
     if (pa0 == 0)
       return -1;
     n = PAGESIZE - (srcva - va0);
@@ -400,13 +413,82 @@ int ismapped(pagetable_t pagetable, uint64 va) {
   return 0;
 }
 
-uint64 vmfault(pagetable_t pagetable, uint64 va, int read) {
+// Is va a user page that uvmshare() mapped read-only?
+int iscow(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+
+  if (va >= MAXVA || (pte = walk_lookup(pagetable, va)) == 0)
+    return 0;
+  return (*pte & (PTE_V | PTE_U | PTE_COW)) == (PTE_V | PTE_U | PTE_COW);
+}
+
+// Map page pa, which someone else (the page cache) also holds,
+// read-only at user address va, in place of the page there,
+// which is freed. Saves copying a page into user memory; a
+// write to it gets a copy of its own from uvmcow().
+// Returns -1, changing nothing, if va is not a user page the
+// process may write (PTE_W, or PTE_COW from an earlier
+// uvmshare()), or is executable: copyout() must be used for
+// those, and fail where it fails. The caller checks that va is
+// below p->sz, since mmap() pages carry PTE_COW of their own.
+int uvmshare(pagetable_t pagetable, uint64 va, uint64 pa) {
+  pte_t *pte;
+  uint64 old;
+
+  if (va >= MAXVA || va % PAGESIZE != 0 ||
+      (pte = walk_lookup(pagetable, va)) == 0 ||
+      (*pte & (PTE_V | PTE_U | PTE_X)) != (PTE_V | PTE_U) ||
+      (*pte & (PTE_W | PTE_COW)) == 0)
+    return -1;
+  old = PTE2PA(*pte);
+  if (old != pa) {
+    page_dup((void *)pa);
+    *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+    free_page((void *)old);
+  }
+  return 0;
+}
+
+// Give the user page at va, mapped by uvmshare(), back its
+// write permission, copying it first if it is still shared.
+// Returns -1 if va is not such a page or there is no memory.
+int uvmcow(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  va = PAGEROUNDDOWN(va);
+  if (!iscow(pagetable, va))
+    return -1;
+  pte = walk_lookup(pagetable, va);
+  pa = PTE2PA(*pte);
+  if (page_refs((void *)pa) > 1) {
+    if ((mem = alloc_page()) == 0)
+      return -1;
+    memmove(mem, (void *)pa, PAGESIZE);
+    free_page((void *)pa);
+    pa = (uint64)mem;
+  }
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  return 0;
+}
+
+// Handle a user page fault at va, or make the page at va ready
+// for copyout() or copyin(): a write to a page shared copy-on-
+// write, a page in an mmap() region (mmapfault()), or a page
+// below p->sz not allocated yet. Returns the page's physical
+// address, or 0 if the access is not allowed.
+uint64 vmfault(pagetable_t pagetable, uint64 va, int write) {
   uint64 mem;
   struct proc *p = myproc();
 
-  if (va >= p->sz)
+  if (va >= MAXVA)
     return 0;
   va = PAGEROUNDDOWN(va);
+  if (write && iscow(pagetable, va))
+    return uvmcow(pagetable, va) < 0 ? 0 : walkaddr(pagetable, va);
+  if (va >= p->sz)
+    return mmapfault(p, va, write);
   if (ismapped(pagetable, va)) {
     return 0;
   }
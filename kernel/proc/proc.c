@@ -209,6 +209,7 @@ static void freeproc(struct proc *p) {
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  memset(p->vma, 0, sizeof(p->vma));
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -260,6 +261,9 @@ int growproc(int n) {
 
   sz = p->sz;
   if (n > 0) {
+    // the heap must not grow into the mmap() regions above it.
+    if (sz + n > mmapbase(p))
+      return -1;
     if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
@@ -292,6 +296,13 @@ int fork(void) {
   }
   np->sz = p->sz;
 
+  // and the mmap() regions.
+  if (mmapcopy(p, np) < 0) {
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -410,6 +421,9 @@ void exit(int status) {
   // end_op();
   // p->cwd = 0;
 
+  // Write back and drop mmap() regions.
+  munmapall(p);
+
   acquire(&wait_lock);
 
   // Give any children to init.
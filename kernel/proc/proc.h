@@ -92,6 +92,17 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory made by mmap(): [start, end), backed
+// by f from offset off, or anonymous if f is 0.
+struct vma {
+  uint64 start;
+  uint64 end; // 0: slot is free
+  int prot;   // PROT_*
+  int flags;  // MAP_*
+  struct file *f;
+  uint off;
+};
+
 enum procstate {
   UNUSED,   // 进程槽位未使用
   USED,     // 进程已分配但未初始化完成
@@ -128,6 +139,8 @@ struct proc {
   struct context context;      // swtch() here to run process 切换到进程的上下文
   struct file *ofile[NOFILE];  // Open files 打开的文件
   struct inode *cwd;           // Current directory 当前工作目录
+  struct vma vma[NVMA];        // mmap() regions 内存映射区域
+  int logblocks;               // log blocks reserved by begin_op()
   char name[16];               // Process name (debugging) 进程名称
 };
 
@@ -0,0 +1,1909 @@
+// Lab6: file system tests and benchmarks
+#include "../fs/buf.h"
+#include "../fs/fcntl.h"
+#include "../fs/file.h"
+#include "../fs/fs.h"
+#include "../fs/log.h"
+#include "../fs/stat.h"
+#include "../include/defs.h"
+#include "../include/memlayout.h"
+#include "../include/param.h"
+#include "../include/riscv.h"
+#include "../proc/proc.h"
+
+// 简单的 assert 宏
+#define assert(x)                                                              \
+  do {                                                                         \
+    if (!(x)) {                                                                \
+      printf("Assertion failed: %s at %s:%d\n", #x, __FILE__, __LINE__);       \
+      for (;;)                                                                 \
+        ;                                                                      \
+    }                                                                          \
+  } while (0)
+
+// qemu's timer runs at 10MHz
+#define CYCLES_PER_SEC 10000000UL
+
+// Create a file or directory, like create() in sysfile.c.
+// Must be called inside a transaction.
+// Returns the locked inode, or 0.
+static struct inode *fcreate(char *path, short type) {
+  struct inode *ip, *dp;
+  char name[DIRSIZ];
+
+  if ((dp = nameiparent(path, name)) == 0)
+    return 0;
+  ilock(dp);
+  if ((ip = dirlookup(dp, name, 0)) != 0) {
+    iunlockput(dp);
+    ilock(ip);
+    return ip;
+  }
+  if ((ip = ialloc(dp->dev, type, dp->inum)) == 0) {
+    iunlockput(dp);
+    return 0;
+  }
+  ilock(ip);
+  ip->nlink = 1;
+  iupdate(ip);
+  if ((type == T_DIR &&
+       (dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)) ||
+      dirlink(dp, name, ip->inum) < 0) {
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
+  if (type == T_DIR) {
+    dp->nlink++; // for ".."
+    iupdate(dp);
+  }
+  iunlockput(dp);
+  return ip;
+}
+
+// "/<prefix><a><b>", with a and b as letters.
+static void make_path(char *path, char *prefix, int a, int b) {
+  int n = 0;
+
+  path[n++] = '/';
+  while (*prefix)
+    path[n++] = *prefix++;
+  path[n++] = 'a' + a;
+  path[n++] = 'a' + b;
+  path[n] = 0;
+}
+
+// Group commit: small-file creates from 1 and 8 concurrent writers.
+#define GC_FILES 20
+static struct spinlock gc_lock;
+static int gc_next;
+static char *gc_prefix; // file names of this round
+static int gc_blocks;   // begin_op() estimate per create
+
+static void gc_writer(void) {
+  char path[16];
+  int id;
+
+  acquire(&gc_lock);
+  id = gc_next++;
+  release(&gc_lock);
+
+  for (int i = 0; i < GC_FILES; i++) {
+    make_path(path, gc_prefix, id, i);
+    begin_op(gc_blocks);
+    struct inode *ip = fcreate(path, T_FILE);
+    assert(ip != 0);
+    iunlockput(ip);
+    end_op();
+  }
+}
+
+void test_group_commit(void) {
+  int writers[] = {1, 8};
+  char *prefix[] = {"g1", "g8"};
+  struct logstat s0, s1;
+
+  printf("Testing group commit...\n");
+  initlock(&gc_lock, "gc_lock");
+
+  for (int r = 0; r < NELEM(writers); r++) {
+    int n = writers[r];
+    gc_next = 0;
+    gc_prefix = prefix[r];
+    gc_blocks = LINKOPBLOCKS;
+    logstat(&s0);
+    uint64 t0 = r_time();
+    for (int i = 0; i < n; i++)
+      assert(kthread_create(gc_writer) > 0);
+    for (int i = 0; i < n; i++)
+      wait(0);
+    uint64 cycles = r_time() - t0;
+    logstat(&s1);
+
+    uint64 creates = n * GC_FILES;
+    printf("%d writers: %ld creates in %ld commits, %ld creates/s\n", n,
+           creates, s1.ncommit - s0.ncommit,
+           creates * CYCLES_PER_SEC / (cycles ? cycles : 1));
+  }
+  printf("Group commit test completed\n");
+}
+
+// Transaction size: how many concurrent creates share one
+// transaction when each reserves only what a create writes
+// (directory and new inode, a directory block and its bitmap
+// block, and the parent's inode block), plus what adding a name
+// to a hashed directory may write, instead of LINKOPBLOCKS.
+#define CREATEBLOCKS (5 + HTOPBLOCKS)
+
+void test_log_concurrency(void) {
+  int writers[] = {1, 4, 10};
+  char *prefix[] = {"ca", "cb", "cc"};
+  struct logstat s0, s1;
+
+  printf("Testing log concurrency...\n");
+  printf("log holds %d blocks per transaction\n", log_maxop());
+  for (int r = 0; r < NELEM(writers); r++) {
+    int n = writers[r];
+    gc_next = 0;
+    gc_prefix = prefix[r];
+    gc_blocks = CREATEBLOCKS;
+    logstat(&s0);
+    for (int i = 0; i < n; i++)
+      assert(kthread_create(gc_writer) > 0);
+    for (int i = 0; i < n; i++)
+      wait(0);
+    logstat(&s1);
+
+    uint64 ops = s1.nop - s0.nop;
+    uint64 commits = s1.ncommit - s0.ncommit;
+    assert(ops == n * GC_FILES && commits > 0);
+    printf("%d writers: %ld ops in %ld commits, %ld ops per commit, "
+           "at most %ld\n",
+           n, ops, commits, ops / commits, s1.maxtxops);
+  }
+  printf("Log concurrency test completed\n");
+}
+
+// Checkpointing: write amplification (disk blocks written per block
+// modified by an op) and end_op() latency of small-file creates,
+// then the background checkpoint of an idle log.
+#define CP_FILES 40
+
+void test_checkpoint(void) {
+  char path[16];
+  struct logstat s0, s1;
+  uint64 wait = 0;
+
+  printf("Testing checkpoint...\n");
+  logstat(&s0);
+  for (int i = 0; i < CP_FILES; i++) {
+    make_path(path, "cp", i / 26, i % 26);
+    begin_op(LINKOPBLOCKS);
+    struct inode *ip = fcreate(path, T_FILE);
+    assert(ip != 0);
+    iunlockput(ip);
+    uint64 t0 = r_time();
+    end_op();
+    wait += r_time() - t0;
+  }
+  logstat(&s1);
+
+  uint64 logged = s1.nlogged - s0.nlogged;
+  uint64 written = (s1.nlogwrite - s0.nlogwrite) +
+                   (s1.ninstall - s0.ninstall) + (s1.nhead - s0.nhead);
+  assert(logged > 0);
+  printf("%ld blocks logged, %ld written (%ld log, %ld installed, %ld "
+         "header), %ld%% amplification\n",
+         logged, written, s1.nlogwrite - s0.nlogwrite,
+         s1.ninstall - s0.ninstall, s1.nhead - s0.nhead,
+         written * 100 / logged);
+  printf("end_op: %ld us average\n",
+         wait * 1000000 / CYCLES_PER_SEC / CP_FILES);
+
+  // nothing more is committed, so the checkpoint thread
+  // should install the rest within a few ticks.
+  uint64 ncheckpoint = s1.ncheckpoint;
+  uint64 t0 = r_time();
+  do {
+    yield();
+    logstat(&s1);
+    assert(r_time() - t0 < CYCLES_PER_SEC * 5);
+  } while (s1.ncheckpoint == ncheckpoint);
+  printf("Checkpoint test completed\n");
+}
+
+// Large files: 16MB written and read back sequentially, the
+// writes in chunks the size filewrite() would use.
+#define LF_SIZE (16 * 1024 * 1024)
+static char lf_buf[16 * BSIZEMAX];
+
+// Number of extents mapping locked inode ip.
+static int count_extents(struct inode *ip) {
+  struct buf *ibp, *bp;
+  struct extent *e;
+  uint *a;
+  int n = 0;
+
+  for (int i = 0; i < NIEXTENT && ip->ext.e[i].len > 0; i++)
+    n++;
+  if (ip->ext.blk) {
+    ibp = bread(ip->dev, ip->ext.blk);
+    a = (uint *)ibp->data;
+    for (int k = 0; k < NINDIRECT && a[k]; k++) {
+      bp = bread(ip->dev, a[k]);
+      e = (struct extent *)bp->data;
+      for (int i = 0; i < NXEXTENT && e[i].len > 0; i++)
+        n++;
+      brelse(bp);
+    }
+    brelse(ibp);
+  }
+  return n;
+}
+
+// Create path, or empty it if an earlier boot left it behind.
+// extents selects the block mapping. Returns it unlocked.
+static struct inode *lf_create(char *path, int extents) {
+  begin_op(LINKOPBLOCKS);
+  struct inode *ip = fcreate(path, T_FILE);
+  assert(ip != 0);
+  itrunc(ip);
+  ip->flags = extents ? I_EXTENTS : 0;
+  iupdate(ip);
+  iunlock(ip);
+  end_op();
+  return ip;
+}
+
+// Fill ip with size bytes, each block tagged with its number.
+static void lf_write(struct inode *ip, uint size) {
+  int chunk = ((log_maxop() - 1 - 1 - 2) / 2) * BSIZE;
+  uint off, n;
+
+  if (chunk > sizeof(lf_buf))
+    chunk = sizeof(lf_buf);
+  for (off = 0; off < size; off += n) {
+    n = size - off < chunk ? size - off : chunk;
+    for (uint j = 0; j < n; j += BSIZE)
+      *(uint *)(lf_buf + j) = (off + j) / BSIZE; // tag each block
+    begin_op((n / BSIZE) * 2 + 1 + 1 + 2);
+    ilock(ip);
+    assert(writei(ip, 0, (uint64)lf_buf, off, n) == n);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Read ip back n bytes at a time and check the tags. With
+// uncached, forget the inode's block mappings before each read.
+static void lf_read(struct inode *ip, uint size, uint n, int uncached) {
+  for (uint off = 0; off < size; off += n) {
+    ilock(ip);
+    if (uncached)
+      memset(ip->runs, 0, sizeof(ip->runs));
+    assert(readi(ip, 0, (uint64)lf_buf, off, n) == n);
+    iunlock(ip);
+    for (uint j = 0; j < n; j += BSIZE)
+      assert(*(uint *)(lf_buf + j) == (off + j) / BSIZE);
+  }
+}
+
+// Give the space back and drop the reference.
+static void lf_free(struct inode *ip) {
+  begin_op(MAXOPBLOCKS);
+  ilock(ip);
+  itrunc(ip);
+  iunlockput(ip);
+  end_op();
+}
+
+void test_large_file(void) {
+  printf("Testing large file...\n");
+  struct inode *ip = lf_create("/large", 1);
+  struct logstat s0, s1;
+
+  logstat(&s0);
+  uint64 t0 = r_time();
+  lf_write(ip, LF_SIZE);
+  uint64 wcycles = r_time() - t0;
+  logstat(&s1);
+
+  t0 = r_time();
+  lf_read(ip, LF_SIZE, sizeof(lf_buf), 0);
+  uint64 rcycles = r_time() - t0;
+
+  ilock(ip);
+  assert(ip->size == LF_SIZE);
+  int next = count_extents(ip);
+  iunlock(ip);
+  printf("16MB in %d extents: write %ld KB/s, read %ld KB/s\n", next,
+         (uint64)(LF_SIZE / 1024) * CYCLES_PER_SEC / (wcycles ? wcycles : 1),
+         (uint64)(LF_SIZE / 1024) * CYCLES_PER_SEC / (rcycles ? rcycles : 1));
+  // full-block appends are not zeroed first: about one
+  // log_write() and one log block per block.
+  printf("per MB appended: %ld log_writes, %ld log blocks written\n",
+         (s1.nlogged - s0.nlogged) / (LF_SIZE / (1024 * 1024)),
+         (s1.nlogwrite - s0.nlogwrite) / (LF_SIZE / (1024 * 1024)));
+  assert(s1.nlogged - s0.nlogged < 2 * (LF_SIZE / BSIZE));
+
+  lf_free(ip);
+
+  // a file in one-block pieces: before each block of /frag,
+  // /fragx takes the block after /frag's last, so every block
+  // is an extent, more than the inode and one extent block
+  // hold. Read back without the mapping cache, every lookup
+  // walks the extent blocks.
+  struct inode *fp = lf_create("/frag", 1);
+  struct inode *xp = lf_create("/fragx", 1);
+  uint nfrag = NIEXTENT + NXEXTENT + NXEXTENT / 4;
+  for (uint bn = 0; bn < nfrag; bn++) {
+    *(uint *)lf_buf = bn;
+    begin_op(2 * 2 + 1 + 1 + 2);
+    ilock(xp);
+    ilock(fp);
+    if (bn > 0) {
+      xp->goal = fp->goal;
+      assert(writei(xp, 0, (uint64)lf_buf, (bn - 1) * BSIZE, BSIZE) == BSIZE);
+    }
+    assert(writei(fp, 0, (uint64)lf_buf, bn * BSIZE, BSIZE) == BSIZE);
+    iunlock(fp);
+    iunlock(xp);
+    end_op();
+  }
+  ilock(fp);
+  assert(count_extents(fp) == nfrag);
+  iunlock(fp);
+  lf_read(fp, nfrag * BSIZE, BSIZE, 1);
+  printf("fragmented file: %d one-block extents\n", nfrag);
+  lf_free(xp);
+  lf_free(fp);
+  printf("Large file test completed\n");
+}
+
+// Block size: sequential write and read of an 8MB file, and
+// creating BS_FILES small files of BS_SMALL bytes each, one
+// transaction apiece, at the block size the disk was formatted
+// with (mkfs -b). Each block moves in one disk request, so
+// larger blocks mean fewer requests per MB; a small file still
+// takes a whole block.
+#define BS_SIZE (8 * 1024 * 1024)
+#define BS_FILES 100
+#define BS_SMALL 700
+
+void test_bsize(void) {
+  struct bstat b0, b1;
+  char path[16];
+  uint64 t0, wcycles, rcycles, ccycles;
+
+  printf("Testing block size %d...\n", BSIZE);
+  struct inode *ip = lf_create("/bsize", 1);
+  t0 = r_time();
+  lf_write(ip, BS_SIZE);
+  flush_all_blocks(ROOTDEV);
+  wcycles = r_time() - t0;
+
+  bstat(&b0);
+  t0 = r_time();
+  lf_read(ip, BS_SIZE, sizeof(lf_buf), 0);
+  rcycles = r_time() - t0;
+  bstat(&b1);
+  lf_free(ip);
+
+  memset(lf_buf, 'b', BS_SMALL);
+  t0 = r_time();
+  for (int i = 0; i < BS_FILES; i++) {
+    make_path(path, "bs", i / 26, i % 26);
+    begin_op(LINKOPBLOCKS);
+    ip = fcreate(path, T_FILE);
+    assert(ip != 0);
+    assert(writei(ip, 0, (uint64)lf_buf, 0, BS_SMALL) == BS_SMALL);
+    iunlockput(ip);
+    end_op();
+  }
+  ccycles = r_time() - t0;
+  for (int i = 0; i < BS_FILES; i++) {
+    make_path(path, "bs", i / 26, i % 26);
+    lf_free(lf_create(path, 0));
+  }
+
+  printf("block size %d: write %ld KB/s, read %ld KB/s (%ld misses), "
+         "%ld us per small file\n",
+         BSIZE,
+         (uint64)(BS_SIZE / 1024) * CYCLES_PER_SEC / (wcycles ? wcycles : 1),
+         (uint64)(BS_SIZE / 1024) * CYCLES_PER_SEC / (rcycles ? rcycles : 1),
+         (b1.miss[b1.policy] - b0.miss[b0.policy]),
+         ccycles * 1000000 / CYCLES_PER_SEC / BS_FILES);
+  printf("Block size test completed\n");
+}
+
+// Page cache: read a 1MB file with fileread() into user memory,
+// 4KB and 64KB at a time, and report MB/s, against readi() into
+// the same memory. The buffer cache holds NBUF blocks, less than
+// the file, so readi() keeps going to the disk; the page cache
+// holds all of it. 64KB reads map the cached pages into the user
+// page table instead of copying them, and a write to one of
+// those gets a copy of its own.
+#define PC_SIZE (1024 * 1024)
+#define PC_UBUF (64 * 1024) // user buffer, at address 0
+#define PC_ROUNDS 4
+#define PC_RO (4 * PAGESIZE) // read-only user pages, at PC_UBUF
+
+// Check that the user buffer holds the n bytes at off, by the
+// tags of the blocks that start in it.
+static void pc_check(uint off, uint n) {
+  uint tag;
+
+  for (uint j = (BSIZE - off % BSIZE) % BSIZE; j < n; j += BSIZE) {
+    assert(copyin(myproc()->pagetable, (char *)&tag, j, sizeof(tag)) == 0);
+    assert(tag == (off + j) / BSIZE);
+  }
+}
+
+// Read the file PC_ROUNDS times, n bytes at a time, with
+// fileread(), or readi() if f is 0. Returns MB/s.
+static uint64 pc_read(struct file *f, struct inode *ip, uint n) {
+  uint64 t0 = r_time(), t;
+
+  for (int r = 0; r < PC_ROUNDS; r++) {
+    for (uint off = 0; off < PC_SIZE; off += n) {
+      if (f) {
+        assert(fileread(f, 0, n) == n);
+      } else {
+        ilock(ip);
+        assert(readi(ip, 1, 0, off, n) == n);
+        iunlock(ip);
+      }
+      if (r == 0)
+        pc_check(off, n);
+    }
+    if (f)
+      f->off = 0;
+  }
+  t = r_time() - t0;
+  return (uint64)PC_ROUNDS * (PC_SIZE / 1024) * CYCLES_PER_SEC / 1024 /
+         (t ? t : 1);
+}
+
+void test_pcache(void) {
+  struct proc *p = myproc();
+  struct fsstat s0, s1;
+  struct file *f;
+  uint64 va;
+  uint tag;
+
+  printf("Testing page cache...\n");
+  struct inode *ip = lf_create("/pcache", 1);
+  lf_write(ip, PC_SIZE);
+  assert((p->sz = uvmalloc(p->pagetable, 0, PC_UBUF,
+                           PTE_R | PTE_W | PTE_U)) == PC_UBUF);
+  assert((f = filealloc()) != 0);
+  f->type = FD_INODE;
+  f->ip = idup(ip);
+  f->off = 0;
+  f->readable = 1;
+  f->writable = 0;
+
+  for (uint n = 4096; n <= PC_UBUF; n *= 16) {
+    uint64 bufrate = pc_read(0, ip, n);
+    fsstat(&s0);
+    uint64 pcrate = pc_read(f, ip, n);
+    fsstat(&s1);
+    printf("%d-byte reads: readi %ld MB/s, page cache %ld MB/s "
+           "(%ld pages read in, %ld mapped)\n",
+           n, bufrate, pcrate, s1.npfill - s0.npfill, s1.npmap - s0.npmap);
+    if (n >= 4 * PAGESIZE)
+      assert(s1.npmap > s0.npmap);
+  }
+
+  // the user buffer now shares the file's last 64KB with the
+  // cache; writing to it must not change the file.
+  assert(copyout(p->pagetable, 0, "x", 1) == 0);
+  ilock(ip);
+  assert(pcache_read(ip, 0, (uint64)&tag, PC_SIZE - PC_UBUF, sizeof(tag)) ==
+         sizeof(tag));
+  iunlock(ip);
+  assert(tag == (PC_SIZE - PC_UBUF) / BSIZE);
+
+  // read() must not map the cache into pages the process cannot
+  // write: read-only pages below p->sz, like text, and a
+  // PROT_READ mapping. Both reads fail, as copyout() does, and
+  // the pages stay read-only.
+  assert((p->sz = uvmalloc(p->pagetable, PC_UBUF, PC_UBUF + PC_RO,
+                           PTE_R | PTE_U)) == PC_UBUF + PC_RO);
+  f->off = 0;
+  assert(fileread(f, PC_UBUF, PC_RO) == -1);
+  assert(copyin(p->pagetable, (char *)&tag, PC_UBUF, sizeof(tag)) == 0);
+  assert(tag == 0);
+  assert(copyout(p->pagetable, PC_UBUF, "x", 1) == -1);
+  va = mmap(0, PC_RO, PROT_READ, MAP_PRIVATE, f, 0);
+  assert(va != -1);
+  for (uint j = 0; j < PC_RO; j += PAGESIZE)
+    assert(copyin(p->pagetable, (char *)&tag, va + j, sizeof(tag)) == 0);
+  f->off = PC_RO;
+  assert(fileread(f, va, PC_RO) == -1);
+  assert(copyin(p->pagetable, (char *)&tag, va, sizeof(tag)) == 0);
+  assert(tag == 0);
+  assert(copyout(p->pagetable, va, "x", 1) == -1);
+  assert(munmap(va, PC_RO) == 0);
+
+  fileclose(f);
+  p->sz = uvmdealloc(p->pagetable, PC_UBUF + PC_RO, 0);
+  lf_free(ip);
+  printf("Page cache test completed\n");
+}
+
+// Delayed allocation: 1MB appended 100 bytes at a time, first
+// with a transaction per write, as filewrite() used to, then
+// with filewrite(), whose writes wait in the page cache until
+// iflush() gives them blocks. Reports KB/s, log commits and
+// extents for each, and checks what reached the disk.
+#define DA_SIZE (1024 * 1024)
+#define DA_WRITE 100
+#define DA_PERIOD 251 // byte i of the file is i % DA_PERIOD
+
+static char da_buf[DA_PERIOD + DA_WRITE];
+
+// Check that ip holds DA_SIZE bytes of the pattern, all of
+// them in its blocks.
+static void da_check(struct inode *ip) {
+  ilock(ip);
+  assert(ip->size == DA_SIZE && ip->dsize == DA_SIZE);
+  for (uint off = 0; off < DA_SIZE; off += sizeof(lf_buf)) {
+    assert(readi(ip, 0, (uint64)lf_buf, off, sizeof(lf_buf)) ==
+           sizeof(lf_buf));
+    for (uint j = 0; j < sizeof(lf_buf); j++)
+      assert(lf_buf[j] == (char)((off + j) % DA_PERIOD));
+  }
+  iunlock(ip);
+}
+
+static void da_report(char *how, struct inode *ip, uint64 t,
+                      struct logstat *s0, struct logstat *s1) {
+  ilock(ip);
+  int next = count_extents(ip);
+  iunlock(ip);
+  printf("%s: %ld KB/s, %ld commits, %d extents\n", how,
+         (uint64)(DA_SIZE / 1024) * CYCLES_PER_SEC / (t ? t : 1),
+         s1->ncommit - s0->ncommit, next);
+}
+
+void test_delalloc(void) {
+  struct proc *p = myproc();
+  struct logstat s0, s1;
+  struct fsstat f0, f1;
+  struct inode *ip;
+  struct file *f;
+  uint64 t0;
+  uint n;
+
+  printf("Testing delayed allocation...\n");
+  for (int j = 0; j < sizeof(da_buf); j++)
+    da_buf[j] = j % DA_PERIOD;
+
+  ip = lf_create("/delalloc", 1);
+  logstat(&s0);
+  t0 = r_time();
+  for (uint off = 0; off < DA_SIZE; off += n) {
+    n = DA_SIZE - off < DA_WRITE ? DA_SIZE - off : DA_WRITE;
+    begin_op(1 + 1 + 2);
+    ilock(ip);
+    assert(writei(ip, 0, (uint64)da_buf + off % DA_PERIOD, off, n) == n);
+    iunlock(ip);
+    end_op();
+  }
+  t0 = r_time() - t0;
+  logstat(&s1);
+  da_report("transaction per write", ip, t0, &s0, &s1);
+  da_check(ip);
+  lf_free(ip);
+
+  ip = lf_create("/delalloc", 1);
+  assert(uvmalloc(p->pagetable, 0, PAGESIZE, PTE_R | PTE_W | PTE_U) ==
+         PAGESIZE);
+  assert(copyout(p->pagetable, 0, da_buf, sizeof(da_buf)) == 0);
+  assert((f = filealloc()) != 0);
+  f->type = FD_INODE;
+  f->ip = idup(ip);
+  f->off = 0;
+  f->readable = 0;
+  f->writable = 1;
+  logstat(&s0);
+  fsstat(&f0);
+  t0 = r_time();
+  for (uint off = 0; off < DA_SIZE; off += n) {
+    n = DA_SIZE - off < DA_WRITE ? DA_SIZE - off : DA_WRITE;
+    assert(filewrite(f, off % DA_PERIOD, n) == n);
+  }
+  iflush(ip);
+  t0 = r_time() - t0;
+  logstat(&s1);
+  fsstat(&f1);
+  da_report("delayed allocation", ip, t0, &s0, &s1);
+  printf("%ld flush transactions\n", f1.nflush - f0.nflush);
+  da_check(ip);
+
+  fileclose(f);
+  uvmdealloc(p->pagetable, PAGESIZE, 0);
+  lf_free(ip);
+  printf("Delayed allocation test completed\n");
+}
+
+// Write-back: commit a few blocks to each of several files,
+// then compare the disk requests flush_all_blocks() takes to
+// write them home with the one per valid buffer it used to
+// issue. Then check that fsync() writes home the blocks of the
+// file written last, whose commits a checkpoint is least likely
+// to have installed already.
+#define WB_FILES 8
+#define WB_SIZE (6 * BSIZE)
+
+void test_writeback(void) {
+  struct inode *ip[WB_FILES];
+  struct bstat b0, b1;
+  struct file *f;
+  char path[] = "/wb0";
+  int i, nreq;
+
+  printf("Testing write-back...\n");
+  for (i = 0; i < WB_FILES; i++) {
+    path[3] = '0' + i;
+    ip[i] = lf_create(path, 1);
+    lf_write(ip[i], WB_SIZE);
+  }
+  bstat(&b0);
+  nreq = flush_all_blocks(ROOTDEV);
+  bstat(&b1);
+  assert(b1.ndirty == 0);
+  assert(nreq <= b1.nwb - b0.nwb);
+  printf("flush_all_blocks: %d requests before (one per valid buffer), "
+         "%d for %ld dirty blocks now\n",
+         b0.nvalid, nreq, b1.nwb - b0.nwb);
+
+  for (i = 0; i < WB_FILES; i++)
+    lf_write(ip[i], WB_SIZE);
+  assert((f = filealloc()) != 0);
+  f->type = FD_INODE;
+  f->ip = idup(ip[WB_FILES - 1]); // the most recently written
+  f->readable = 0;
+  f->writable = 1;
+  bstat(&b0);
+  assert(filesync(f) == 0);
+  bstat(&b1);
+  ilock(f->ip);
+  assert(isync(f->ip) == 0); // nothing of it left dirty
+  iunlock(f->ip);
+  printf("fsync: %ld of %d dirty blocks written\n", b1.nwb - b0.nwb,
+         b0.ndirty);
+  fileclose(f);
+
+  for (i = 0; i < WB_FILES; i++)
+    lf_free(ip[i]);
+  printf("Write-back test completed\n");
+}
+
+// Buffer cache replacement: a thread scans a 1024-block file over and
+// over while this one opens and reads BC_FILES small files in
+// turn, the two taking strict turns of BC_SIZE bytes. The small
+// files fit in the cache, but not beside the scan under LRU.
+// Reports the hit rate and the time per open under LRU and 2Q.
+#define BC_SCAN (1024 * BSIZE)
+#define BC_FILES 48
+#define BC_SIZE (4 * BSIZE)
+#define BC_ROUNDS 20
+
+static struct inode *bc_scanip;
+static volatile int bc_stop;
+static volatile int bc_turn; // 0: the scanner's
+static char bc_sbuf[4 * BSIZEMAX]; // the scanner's
+static char bc_buf[4 * BSIZEMAX];
+
+static void bc_scanner(void) {
+  for (uint off = 0; !bc_stop; off = (off + BC_SIZE) % BC_SCAN) {
+    while (bc_turn != 0 && !bc_stop)
+      yield();
+    ilock(bc_scanip);
+    assert(readi(bc_scanip, 0, (uint64)bc_sbuf, off, BC_SIZE) == BC_SIZE);
+    iunlock(bc_scanip);
+    bc_turn = 1;
+  }
+}
+
+void test_bcache(void) {
+  int policy[] = {BP_LRU, BP_2Q};
+  char *name[] = {"LRU", "2Q"};
+  struct bstat s0, s1;
+  struct inode *ip;
+  char path[16];
+  int old;
+
+  printf("Testing buffer cache replacement...\n");
+  bc_scanip = lf_create("/bcscan", 1);
+  lf_write(bc_scanip, BC_SCAN);
+  for (int i = 0; i < BC_FILES; i++) {
+    make_path(path, "bc", i / 26, i % 26);
+    ip = lf_create(path, 1);
+    lf_write(ip, BC_SIZE);
+    begin_op(MAXOPBLOCKS);
+    iput(ip);
+    end_op();
+  }
+
+  for (int r = 0; r < NELEM(policy); r++) {
+    old = bpolicy(policy[r]);
+    bc_stop = 0;
+    bc_turn = 0;
+    assert(kthread_create(bc_scanner) > 0);
+    bstat(&s0);
+    uint64 t0 = r_time();
+    for (int k = 0; k < BC_ROUNDS; k++) {
+      for (int i = 0; i < BC_FILES; i++) {
+        while (bc_turn != 1)
+          yield();
+        make_path(path, "bc", i / 26, i % 26);
+        begin_op(MAXOPBLOCKS);
+        assert((ip = namei(path)) != 0);
+        end_op();
+        ilock(ip);
+        assert(readi(ip, 0, (uint64)bc_buf, 0, BC_SIZE) == BC_SIZE);
+        iunlock(ip);
+        begin_op(MAXOPBLOCKS);
+        iput(ip);
+        end_op();
+        for (int j = 0; j < BC_SIZE; j += BSIZE)
+          assert(*(uint *)(bc_buf + j) == j / BSIZE);
+        bc_turn = 0;
+      }
+    }
+    uint64 cycles = r_time() - t0;
+    bstat(&s1);
+    bc_stop = 1;
+    wait(0);
+    bpolicy(old);
+
+    uint64 hit = s1.hit[policy[r]] - s0.hit[policy[r]];
+    uint64 miss = s1.miss[policy[r]] - s0.miss[policy[r]];
+    printf("%s: %ld hits, %ld misses (%ld%%), %ld us per open\n", name[r],
+           hit, miss, hit * 100 / (hit + miss),
+           cycles * 1000000 / CYCLES_PER_SEC / (BC_ROUNDS * BC_FILES));
+  }
+
+  lf_free(bc_scanip);
+  for (int i = 0; i < BC_FILES; i++) {
+    make_path(path, "bc", i / 26, i % 26);
+    lf_free(lf_create(path, 1));
+  }
+  printf("Buffer cache replacement test completed\n");
+}
+
+// mmap(): scan a 1MB file through a MAP_PRIVATE mapping, and
+// with read() into a 64KB buffer, and report MB/s for each, with
+// the file already in the page cache. The kernel cannot load
+// from user addresses, so the scan reads one word per block
+// with copyin(), which faults pages in as a user load would.
+// Then checks MAP_SHARED write-back, and that MAP_SHARED
+// mappings and write() see each other's bytes, MAP_PRIVATE
+// copy-on-write, and anonymous memory.
+#define MM_SIZE (1024 * 1024)
+
+// Read the tag of every block that starts in [va, va + n) of
+// the current process, and check it against the file offset
+// off. With blocks larger than a page, va may be mid-block.
+static void mm_scan(uint64 va, uint off, uint n) {
+  uint tag;
+
+  for (uint j = (BSIZE - off % BSIZE) % BSIZE; j < n; j += BSIZE) {
+    assert(copyin(myproc()->pagetable, (char *)&tag, va + j, sizeof(tag)) == 0);
+    assert(tag == (off + j) / BSIZE);
+  }
+}
+
+static struct proc mm_child; // fork()'s child, for mmapcopy()
+
+void test_mmap(void) {
+  struct proc *p = myproc();
+  struct file *f, *rf, *wf;
+  uint64 va, va2, va3, t0, tmap, tread;
+  char word[4];
+
+  printf("Testing mmap...\n");
+  struct inode *ip = lf_create("/mmap", 1);
+  lf_write(ip, MM_SIZE);
+  assert((p->sz = uvmalloc(p->pagetable, 0, PC_UBUF,
+                           PTE_R | PTE_W | PTE_U)) == PC_UBUF);
+  assert((f = filealloc()) != 0);
+  f->type = FD_INODE;
+  f->ip = idup(ip);
+  f->off = 0;
+  f->readable = 1;
+  f->writable = 1;
+  for (uint off = 0; off < MM_SIZE; off += PC_UBUF)
+    assert(fileread(f, 0, PC_UBUF) == PC_UBUF);
+
+  va = mmap(0, MM_SIZE, PROT_READ, MAP_PRIVATE, f, 0);
+  assert(va != -1);
+  t0 = r_time();
+  for (int r = 0; r < PC_ROUNDS; r++)
+    mm_scan(va, 0, MM_SIZE);
+  tmap = r_time() - t0;
+  assert(munmap(va, MM_SIZE) == 0);
+
+  t0 = r_time();
+  for (int r = 0; r < PC_ROUNDS; r++) {
+    f->off = 0;
+    for (uint off = 0; off < MM_SIZE; off += PC_UBUF) {
+      assert(fileread(f, 0, PC_UBUF) == PC_UBUF);
+      mm_scan(0, off, PC_UBUF);
+    }
+  }
+  tread = r_time() - t0;
+  printf("scan 1MB: mmap %ld MB/s, read() %ld MB/s\n",
+         (uint64)PC_ROUNDS * CYCLES_PER_SEC / (tmap ? tmap : 1),
+         (uint64)PC_ROUNDS * CYCLES_PER_SEC / (tread ? tread : 1));
+
+  // MAP_SHARED: a write reaches the file at munmap().
+  va = mmap(0, 2 * PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f, PAGESIZE);
+  assert(va != -1);
+  mm_scan(va, PAGESIZE, 2 * PAGESIZE);
+  assert(copyout(p->pagetable, va + PAGESIZE + 8, "shrd", 4) == 0);
+  assert(munmap(va, 2 * PAGESIZE) == 0);
+  ilock(ip);
+  assert(pcache_read(ip, 0, (uint64)word, 2 * PAGESIZE + 8, 4) == 4);
+  iunlock(ip);
+  assert(memcmp(word, "shrd", 4) == 0);
+
+  // two MAP_SHARED mappings of a page, and write(), all use the
+  // cache's page: each sees the others' writes at once, and
+  // neither munmap() undoes the other's bytes on the disk.
+  va = mmap(0, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f, 3 * PAGESIZE);
+  va2 = mmap(0, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f, 3 * PAGESIZE);
+  assert(va != -1 && va2 != -1);
+  assert(copyout(p->pagetable, va + 16, "one!", 4) == 0);
+  assert(copyout(p->pagetable, va2 + 32, "two!", 4) == 0);
+  assert(copyin(p->pagetable, word, va2 + 16, 4) == 0);
+  assert(memcmp(word, "one!", 4) == 0);
+  assert(copyout(p->pagetable, 0, "wrt!", 4) == 0);
+  f->off = 3 * PAGESIZE + 48;
+  assert(filewrite(f, 0, 4) == 4);
+  assert(copyin(p->pagetable, word, va + 48, 4) == 0);
+  assert(memcmp(word, "wrt!", 4) == 0);
+  assert(munmap(va2, PAGESIZE) == 0);
+  assert(munmap(va, PAGESIZE) == 0);
+  ilock(ip);
+  for (int k = 0; k < 3; k++) {
+    assert(readi(ip, 0, (uint64)word, 3 * PAGESIZE + 16 * (k + 1), 4) == 4);
+    assert(memcmp(word, k == 0 ? "one!" : k == 1 ? "two!" : "wrt!", 4) == 0);
+  }
+  iunlock(ip);
+
+  // MAP_PRIVATE: a write gets a copy; the file keeps its data.
+  va = mmap(0, PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0);
+  assert(va != -1);
+  mm_scan(va, 0, PAGESIZE);
+  assert(copyout(p->pagetable, va + 8, "priv", 4) == 0);
+  assert(copyin(p->pagetable, word, va + 8, 4) == 0);
+  assert(memcmp(word, "priv", 4) == 0);
+  assert(munmap(va, PAGESIZE) == 0);
+  ilock(ip);
+  assert(pcache_read(ip, 0, (uint64)word, 8, 4) == 4);
+  iunlock(ip);
+  assert(memcmp(word, "priv", 4) != 0);
+
+  // read() and write() with buffers in pages of a mapping not
+  // faulted in yet: of f itself, whose inode they lock, and
+  // through a pipe, under its spinlock. Page 0 maps block 4.
+  va = mmap(0, 2 * PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, f,
+            4 * BSIZE);
+  assert(va != -1);
+  f->off = 4 * BSIZE;
+  assert(fileread(f, va + PAGESIZE, 4) == 4);
+  assert(copyin(p->pagetable, word, va + PAGESIZE, 4) == 0);
+  assert(*(uint *)word == 4);
+  f->off = 4 * BSIZE;
+  assert(filewrite(f, va, 4) == 4);
+  assert(munmap(va, 2 * PAGESIZE) == 0);
+  va = mmap(0, 2 * PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, f,
+            4 * BSIZE);
+  assert(va != -1);
+  assert(pipealloc(&rf, &wf) == 0);
+  assert(filewrite(wf, va, 4) == 4);
+  assert(fileread(rf, va + PAGESIZE, 4) == 4);
+  assert(copyin(p->pagetable, word, va + PAGESIZE, 4) == 0);
+  assert(*(uint *)word == 4);
+  fileclose(rf);
+  fileclose(wf);
+  assert(munmap(va, 2 * PAGESIZE) == 0);
+
+  // fork(): the child maps the parent's pages. MAP_SHARED file
+  // and anonymous pages stay shared both ways, even one neither
+  // has touched yet; a MAP_PRIVATE page is copied by whichever
+  // writes it first.
+  va = mmap(0, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f, 3 * PAGESIZE);
+  va2 = mmap(0, 2 * PAGESIZE, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+  va3 = mmap(0, PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             0, 0);
+  assert(va != -1 && va2 != -1 && va3 != -1);
+  assert(copyout(p->pagetable, va + 64, "fork", 4) == 0);
+  assert(copyout(p->pagetable, va3, "prnt", 4) == 0);
+  memset(&mm_child, 0, sizeof(mm_child));
+  assert((mm_child.pagetable = create_pagetable()) != 0);
+  assert(mmapcopy(p, &mm_child) == 0);
+  assert(copyin(mm_child.pagetable, word, va + 64, 4) == 0);
+  assert(memcmp(word, "fork", 4) == 0);
+  assert(copyout(mm_child.pagetable, va + 68, "chld", 4) == 0);
+  assert(copyin(p->pagetable, word, va + 68, 4) == 0);
+  assert(memcmp(word, "chld", 4) == 0);
+  assert(copyout(p->pagetable, va2 + PAGESIZE, "anon", 4) == 0);
+  assert(copyin(mm_child.pagetable, word, va2 + PAGESIZE, 4) == 0);
+  assert(memcmp(word, "anon", 4) == 0);
+  assert(copyout(mm_child.pagetable, va3, "kid!", 4) == 0);
+  assert(copyin(p->pagetable, word, va3, 4) == 0);
+  assert(memcmp(word, "prnt", 4) == 0);
+  assert(copyout(p->pagetable, va3, "pa2!", 4) == 0);
+  assert(copyin(mm_child.pagetable, word, va3, 4) == 0);
+  assert(memcmp(word, "kid!", 4) == 0);
+  munmapall(&mm_child);
+  destroy_pagetable(mm_child.pagetable);
+  assert(munmap(va, PAGESIZE) == 0);
+  assert(munmap(va2, 2 * PAGESIZE) == 0);
+  assert(munmap(va3, PAGESIZE) == 0);
+  ilock(ip);
+  assert(readi(ip, 0, (uint64)word, 3 * PAGESIZE + 68, 4) == 4);
+  iunlock(ip);
+  assert(memcmp(word, "chld", 4) == 0);
+
+  // anonymous memory starts zeroed; unmapping the middle page
+  // leaves the pages on either side.
+  va = mmap(0, 3 * PAGESIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+  assert(va != -1);
+  assert(copyin(p->pagetable, word, va + PAGESIZE, 4) == 0);
+  assert(word[0] == 0 && word[3] == 0);
+  assert(copyout(p->pagetable, va + 2 * PAGESIZE, "anon", 4) == 0);
+  assert(munmap(va + PAGESIZE, PAGESIZE) == 0);
+  assert(copyin(p->pagetable, word, va + PAGESIZE, 4) == -1);
+  assert(copyin(p->pagetable, word, va + 2 * PAGESIZE, 4) == 0);
+  assert(memcmp(word, "anon", 4) == 0);
+  assert(munmap(va, PAGESIZE) == 0);
+  assert(munmap(va + 2 * PAGESIZE, PAGESIZE) == 0);
+
+  fileclose(f);
+  p->sz = uvmdealloc(p->pagetable, PC_UBUF, 0);
+  lf_free(ip);
+  printf("mmap test completed\n");
+}
+
+// Classic block mapping: a 4MB file reaches into the double-
+// indirect block. Reads it 1KB at a time, like read() with a
+// small buffer, without and with the inode's cache of block
+// mappings, and reports indirect-block reads per MB.
+#define IND_SIZE (4 * 1024 * 1024)
+
+void test_indirect(void) {
+  struct fsstat s0, s1;
+
+  printf("Testing indirect blocks...\n");
+  struct inode *ip = lf_create("/classic", 0);
+  lf_write(ip, IND_SIZE);
+
+  for (int uncached = 1; uncached >= 0; uncached--) {
+    fsstat(&s0);
+    lf_read(ip, IND_SIZE, BSIZE, uncached);
+    fsstat(&s1);
+    printf("%s: %ld indirect reads per MB\n",
+           uncached ? "no mapping cache" : "mapping cache",
+           (s1.nmapread - s0.nmapread) / (IND_SIZE / (1024 * 1024)));
+  }
+
+  lf_free(ip);
+  printf("Indirect block test completed\n");
+}
+
+// Block allocation: writers appending to their own files at the
+// same time, 16 blocks per write. Reports allocation cost and
+// how many extents each file ends up in; a file whose blocks
+// are interleaved with the others' would need one per write.
+#define BA_WRITERS 4
+#define BA_SIZE (2 * 1024 * 1024)
+#define BA_CHUNK (16 * BSIZE)
+static struct spinlock ba_lock;
+static int ba_next;
+static struct inode *ba_ip[BA_WRITERS];
+static char ba_buf[BA_WRITERS][16 * BSIZEMAX];
+
+static void ba_writer(void) {
+  char path[16];
+  int id;
+
+  acquire(&ba_lock);
+  id = ba_next++;
+  release(&ba_lock);
+
+  make_path(path, "ba", id, 0);
+  struct inode *ip = lf_create(path, 1);
+  ba_ip[id] = ip;
+  for (uint off = 0; off < BA_SIZE; off += BA_CHUNK) {
+    for (uint j = 0; j < BA_CHUNK; j += BSIZE)
+      *(uint *)(ba_buf[id] + j) = (off + j) / BSIZE;
+    begin_op((BA_CHUNK / BSIZE) * 2 + 1 + 1 + 2);
+    ilock(ip);
+    assert(writei(ip, 0, (uint64)ba_buf[id], off, BA_CHUNK) == BA_CHUNK);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+void test_balloc(void) {
+  struct fsstat s0, s1;
+
+  printf("Testing block allocation...\n");
+  initlock(&ba_lock, "ba_lock");
+  ba_next = 0;
+
+  fsstat(&s0);
+  uint64 t0 = r_time();
+  for (int i = 0; i < BA_WRITERS; i++)
+    assert(kthread_create(ba_writer) > 0);
+  for (int i = 0; i < BA_WRITERS; i++)
+    wait(0);
+  uint64 cycles = r_time() - t0;
+  fsstat(&s1);
+
+  uint64 nb = s1.nballoc - s0.nballoc;
+  assert(nb >= BA_WRITERS * (BA_SIZE / BSIZE));
+  printf("%ld blocks: %ld us per block, %ld bitmap reads per 1000\n", nb,
+         cycles * 1000000 / CYCLES_PER_SEC / nb,
+         (s1.nbscan - s0.nbscan) * 1000 / nb);
+  for (int i = 0; i < BA_WRITERS; i++) {
+    struct inode *ip = ba_ip[i];
+    ilock(ip);
+    int next = count_extents(ip);
+    iunlock(ip);
+    printf("writer %d: %d writes, %d extents\n", i, BA_SIZE / BA_CHUNK, next);
+    lf_read(ip, BA_SIZE, BA_CHUNK, 0);
+    lf_free(ip);
+  }
+  printf("Block allocation test completed\n");
+}
+
+// Inode allocation: 1000 creates in one new directory. Reports
+// the time for the first and last 100, which should not grow as
+// inodes fill up, and how many inode blocks the files span.
+#define IA_FILES 1000
+
+void test_ialloc(void) {
+  char path[16] = "/ia/f000";
+  uint64 t0, t100 = 0, t900 = 0;
+  uint lo = -1, hi = 0, inum;
+
+  printf("Testing inode allocation...\n");
+  begin_op(LINKOPBLOCKS);
+  struct inode *dp = fcreate("/ia", T_DIR);
+  assert(dp != 0 && dp->type == T_DIR);
+  uint dinum = dp->inum;
+  iunlockput(dp);
+  end_op();
+
+  t0 = r_time();
+  for (int i = 0; i < IA_FILES; i++) {
+    path[5] = '0' + i / 100;
+    path[6] = '0' + i / 10 % 10;
+    path[7] = '0' + i % 10;
+    begin_op(LINKOPBLOCKS); // may split a directory leaf
+    struct inode *ip = fcreate(path, T_FILE);
+    assert(ip != 0);
+    inum = ip->inum;
+    iunlockput(ip);
+    end_op();
+    lo = inum < lo ? inum : lo;
+    hi = inum > hi ? inum : hi;
+    if (i == 99)
+      t100 = r_time() - t0;
+    if (i == IA_FILES - 101)
+      t900 = r_time();
+  }
+  uint64 tlast = r_time() - t900;
+
+  printf("first 100: %ld us, last 100: %ld us\n",
+         t100 * 1000000 / CYCLES_PER_SEC, tlast * 1000000 / CYCLES_PER_SEC);
+  printf("dir inode %d, files %d..%d: %d inode blocks for %d files\n",
+         dinum, lo, hi, hi / IPB - lo / IPB + 1, IA_FILES);
+  printf("Inode allocation test completed\n");
+}
+
+// Inode cache: look up and lock 100 of test_ialloc's files, the
+// way open() does, twice. The second pass should find every
+// inode still valid in the inode table and read no dinodes.
+#define IG_FILES 100
+
+void test_iget(void) {
+  char path[16] = "/ia/f000";
+  struct fsstat s0, s1;
+
+  printf("Testing inode cache...\n");
+  for (int pass = 0; pass < 2; pass++) {
+    fsstat(&s0);
+    uint64 t0 = r_time();
+    for (int i = 0; i < IG_FILES; i++) {
+      path[5] = '0' + i / 100;
+      path[6] = '0' + i / 10 % 10;
+      path[7] = '0' + i % 10;
+      begin_op(MAXOPBLOCKS);
+      struct inode *ip = namei(path);
+      assert(ip != 0);
+      ilock(ip);
+      iunlockput(ip);
+      end_op();
+    }
+    uint64 cycles = r_time() - t0;
+    fsstat(&s1);
+    printf("%s: %ld us per open, %ld dinode reads\n", pass ? "warm" : "cold",
+           cycles * 1000000 / CYCLES_PER_SEC / IG_FILES,
+           s1.niread - s0.niread);
+    if (pass)
+      assert(s1.niread == s0.niread);
+  }
+  printf("Inode cache test completed\n");
+}
+
+// Name cache: stat the same 5-level path 10000 times. After the
+// first walk every component should come from the dcache, with
+// no dirents read. Also checks a negative entry and that
+// creating the name replaces it.
+#define DC_STATS 10000
+
+void test_dcache(void) {
+  char *dirs[] = {"/dc", "/dc/b", "/dc/b/c", "/dc/b/c/d"};
+  char *path = "/dc/b/c/d/file";
+  struct fsstat s0, s1;
+  struct stat st;
+  struct inode *ip;
+
+  printf("Testing name cache...\n");
+  begin_op(LINKOPBLOCKS);
+  for (int i = 0; i < NELEM(dirs); i++) {
+    assert((ip = fcreate(dirs[i], T_DIR)) != 0);
+    iunlockput(ip);
+  }
+  assert((ip = fcreate(path, T_FILE)) != 0);
+  iunlockput(ip);
+  end_op();
+
+  fsstat(&s0);
+  uint64 t0 = r_time();
+  for (int i = 0; i < DC_STATS; i++) {
+    begin_op(MAXOPBLOCKS);
+    assert((ip = namei(path)) != 0);
+    ilock(ip);
+    stati(ip, &st);
+    iunlockput(ip);
+    end_op();
+  }
+  uint64 cycles = r_time() - t0;
+  fsstat(&s1);
+  printf("%d stats: %ld ns each, %ld dirents read, %ld dcache hits\n",
+         DC_STATS, cycles * 1000000000 / CYCLES_PER_SEC / DC_STATS,
+         s1.ndirent - s0.ndirent, s1.ndchit - s0.ndchit);
+  assert(s1.ndirent - s0.ndirent == 0);
+
+  // a name that is not there, then is; unless an earlier boot
+  // already made it.
+  begin_op(LINKOPBLOCKS);
+  if ((ip = namei("/dc/b/c/d/new")) == 0) {
+    fsstat(&s0);
+    assert(namei("/dc/b/c/d/new") == 0);
+    fsstat(&s1);
+    assert(s1.ndirent == s0.ndirent);
+    assert((ip = fcreate("/dc/b/c/d/new", T_FILE)) != 0);
+    uint inum = ip->inum;
+    iunlockput(ip);
+    assert((ip = namei("/dc/b/c/d/new")) != 0 && ip->inum == inum);
+  }
+  iput(ip);
+  end_op();
+  printf("Name cache test completed\n");
+}
+
+// Remove path, like sys_unlink() for a file.
+static void funlink(char *path) {
+  struct inode *ip, *dp;
+  struct dirent de;
+  char name[DIRSIZ];
+  uint off;
+
+  assert((dp = nameiparent(path, name)) != 0);
+  ilock(dp);
+  assert((ip = dirlookup(dp, name, &off)) != 0);
+  ilock(ip);
+  memset(&de, 0, sizeof(de));
+  assert(writei(dp, 0, (uint64)&de, off, sizeof(de)) == sizeof(de));
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
+  iunlockput(dp);
+  ip->nlink--;
+  iupdate(ip);
+  iunlockput(ip);
+}
+
+// prefix followed by i in decimal.
+static void numpath(char *path, char *prefix, int i) {
+  char digits[8];
+  int n = 0, k = 0;
+
+  for (char *p = prefix; *p; p++)
+    path[k++] = *p;
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while (i > 0);
+  while (n > 0)
+    path[k++] = digits[--n];
+  path[k] = 0;
+}
+
+// Large directory: create, look up and unlink 10000 names in
+// one directory. The names are links to one file, so the test
+// does not depend on how many inodes the file system has.
+// Lookups go in a scattered order, and they outnumber the
+// dcache's entries, so most of them read the hashed directory.
+// Halfway through the creates, and after them, the directory
+// is also read the way read() reads it, which must see every
+// name that leaf splits moved. Then fills a leaf with names
+// whose hashes share their low BD_SHARE bits, so that adding one
+// more takes BD_SHARE + 1 splits.
+#define BD_ENTRIES 10000
+#define BD_SHARE 3
+
+// Names in directory dp, read with pcache_read().
+static int bd_count(struct inode *dp) {
+  struct dirent *de;
+  int n = 0;
+
+  ilock(dp);
+  for (uint off = 0; off < dp->size; off += BSIZE) {
+    assert(pcache_read(dp, 0, (uint64)lf_buf, off, BSIZE) == BSIZE);
+    for (de = (struct dirent *)lf_buf; de < (struct dirent *)lf_buf + DPB;
+         de++)
+      n += de->inum != 0;
+  }
+  iunlock(dp);
+  return n;
+}
+
+void test_bigdir(void) {
+  char path[32], name[DIRSIZ];
+  struct inode *dp, *dp2, *ip, *tp;
+  struct fsstat s0, s1;
+  uint64 t0, tcreate, tlookup, tunlink;
+
+  printf("Testing large directory...\n");
+  begin_op(LINKOPBLOCKS);
+  assert((dp = fcreate("/bd", T_DIR)) != 0);
+  iunlock(dp);
+  assert((tp = fcreate("/bd.target", T_FILE)) != 0);
+  iunlock(tp);
+  end_op();
+
+  t0 = r_time();
+  for (int i = 0; i < BD_ENTRIES; i++) {
+    numpath(path, "/bd/entry", i);
+    begin_op(LINKOPBLOCKS);
+    assert(nameiparent(path, name) == dp);
+    ilock(dp);
+    assert(dirlink(dp, name, tp->inum) == 0);
+    iunlock(dp);
+    iput(dp);
+    ilock(tp);
+    tp->nlink++;
+    iupdate(tp);
+    iunlock(tp);
+    end_op();
+    if (i == BD_ENTRIES / 2)
+      assert(bd_count(dp) == i + 1 + 2);
+  }
+  tcreate = r_time() - t0;
+  assert(bd_count(dp) == BD_ENTRIES + 2);
+
+  fsstat(&s0);
+  t0 = r_time();
+  for (int i = 0; i < BD_ENTRIES; i++) {
+    numpath(path, "/bd/entry", (i * 7919) % BD_ENTRIES);
+    begin_op(MAXOPBLOCKS);
+    assert((ip = namei(path)) == tp);
+    iput(ip);
+    end_op();
+  }
+  tlookup = r_time() - t0;
+  fsstat(&s1);
+
+  t0 = r_time();
+  for (int i = 0; i < BD_ENTRIES; i++) {
+    numpath(path, "/bd/entry", i);
+    begin_op(MAXOPBLOCKS);
+    funlink(path);
+    end_op();
+  }
+  tunlink = r_time() - t0;
+
+  begin_op(LINKOPBLOCKS);
+  assert((dp2 = fcreate("/bd2", T_DIR)) != 0);
+  iunlock(dp2);
+  end_op();
+  for (int i = 0, n = 0; n < 2 * DPB; i++) {
+    numpath(name, "s", i);
+    if (crc32c(0, name, strlen(name)) & ((1 << BD_SHARE) - 1))
+      continue;
+    begin_op(LINKOPBLOCKS);
+    ilock(dp2);
+    assert(dirlink(dp2, name, tp->inum) == 0);
+    iunlock(dp2);
+    ilock(tp);
+    tp->nlink++;
+    iupdate(tp);
+    iunlock(tp);
+    end_op();
+    n++;
+  }
+  assert(bd_count(dp2) == 2 * DPB + 2);
+  for (int i = 0, n = 0; n < 2 * DPB; i++) {
+    numpath(name, "s", i);
+    if (crc32c(0, name, strlen(name)) & ((1 << BD_SHARE) - 1))
+      continue;
+    numpath(path, "/bd2/s", i);
+    begin_op(MAXOPBLOCKS);
+    assert((ip = namei(path)) == tp);
+    iput(ip);
+    funlink(path);
+    end_op();
+    n++;
+  }
+
+  ilock(dp);
+  printf("%d entries in %d blocks: per op create %ld us, lookup %ld us, "
+         "unlink %ld us\n",
+         BD_ENTRIES, dp->size / BSIZE,
+         tcreate * 1000000 / CYCLES_PER_SEC / BD_ENTRIES,
+         tlookup * 1000000 / CYCLES_PER_SEC / BD_ENTRIES,
+         tunlink * 1000000 / CYCLES_PER_SEC / BD_ENTRIES);
+  printf("%ld dirents read per lookup\n",
+         (s1.ndirent - s0.ndirent) / BD_ENTRIES);
+  assert(dp->flags & I_HASHDIR);
+  iunlock(dp);
+  ilock(tp);
+  assert(tp->nlink == 1);
+  iunlock(tp);
+  numpath(path, "/bd/entry", 0);
+  assert(namei(path) == 0);
+  begin_op(MAXOPBLOCKS);
+  iput(dp);
+  iput(dp2);
+  iput(tp);
+  end_op();
+  printf("Large directory test completed\n");
+}
+
+// Directory scan: look up names that are not in a directory of
+// 31 dirents, so that every lookup misses the dcache and reads
+// the whole directory. Reports the time per dirent scanned.
+// Also checks isdirempty() on the way.
+#define DS_FILES 29 // with "." and "..", one block less a slot
+#define DS_LOOKUPS 10000
+
+void test_dirscan(void) {
+  char path[32];
+  struct inode *dp, *ip;
+  struct fsstat s0, s1;
+  uint64 t0, cycles, n;
+
+  printf("Testing directory scan...\n");
+  begin_op(LINKOPBLOCKS);
+  assert((dp = fcreate("/ds", T_DIR)) != 0);
+  assert(isdirempty(dp));
+  iunlock(dp);
+  for (int i = 0; i < DS_FILES; i++) {
+    numpath(path, "/ds/f", i);
+    assert((ip = fcreate(path, T_FILE)) != 0);
+    iunlockput(ip);
+  }
+  end_op();
+
+  fsstat(&s0);
+  t0 = r_time();
+  ilock(dp);
+  for (int i = 0; i < DS_LOOKUPS; i++) {
+    numpath(path, "m", i);
+    assert(dirlookup(dp, path, 0) == 0);
+  }
+  assert(!isdirempty(dp));
+  iunlock(dp);
+  cycles = r_time() - t0;
+  fsstat(&s1);
+  n = s1.ndirent - s0.ndirent;
+  printf("%ld dirents scanned, %ld ns each\n", n,
+         cycles * 1000000000 / CYCLES_PER_SEC / n);
+  assert(n == (uint64)DS_LOOKUPS * (DS_FILES + 2));
+
+  for (int i = 0; i < DS_FILES; i++) {
+    numpath(path, "/ds/f", i);
+    begin_op(MAXOPBLOCKS);
+    funlink(path);
+    end_op();
+  }
+  ilock(dp);
+  assert(isdirempty(dp));
+  iunlock(dp);
+  begin_op(MAXOPBLOCKS);
+  iput(dp);
+  end_op();
+  printf("Directory scan test completed\n");
+}
+
+// Inline data: write a tree of tiny files with classic block
+// maps, which keep a file's bytes in a block, then a tree of
+// TI_FILES extent-mapped ones, which go in their inodes. The
+// first has as many files only with 1KB blocks; it would not
+// fit the disk with larger ones. Reports the blocks each tree
+// took and the disk reads to read it back. Then checks that
+// delayed writes that outgrow an inline file move its bytes to
+// a block.
+#define TI_FILES 10000
+#define TI_PERDIR 100
+
+static char ti_buf[NINLINE + 100];
+static char ti_want[NINLINE];
+
+// File i of a tree: dir<i / TI_PERDIR>/f<i % TI_PERDIR>, or
+// without file, the directory.
+static void ti_path(char *path, char *dir, int i, int file) {
+  int n;
+
+  numpath(path, dir, i / TI_PERDIR);
+  if (file) {
+    n = strlen(path);
+    path[n++] = '/';
+    path[n++] = 'f';
+    numpath(path + n, "", i % TI_PERDIR);
+  }
+}
+
+// Create, read back and remove nfiles files of a tree under
+// top, whose directories are dir<n>, inline if they may be.
+// Returns the blocks allocated.
+static uint64 ti_round(char *how, char *top, char *dir, int nfiles, int inl) {
+  char path[32];
+  struct fsstat f0, f1;
+  struct bstat b0, b1;
+  struct inode *ip;
+  uint64 t0, nblk, nread = 0;
+  int n;
+
+  fsstat(&f0);
+  begin_op(LINKOPBLOCKS);
+  assert((ip = fcreate(top, T_DIR)) != 0);
+  iunlockput(ip);
+  end_op();
+  for (int i = 0; i < nfiles; i++) {
+    if (i % TI_PERDIR == 0) {
+      ti_path(path, dir, i, 0);
+      begin_op(LINKOPBLOCKS);
+      assert((ip = fcreate(path, T_DIR)) != 0);
+      iunlockput(ip);
+      end_op();
+    }
+    ti_path(path, dir, i, 1);
+    numpath(ti_want, "tiny file ", i);
+    n = strlen(ti_want);
+    begin_op(LINKOPBLOCKS);
+    assert((ip = fcreate(path, T_FILE)) != 0);
+    if (!inl)
+      ip->flags = 0; // classic, written by writei()
+    assert(writei(ip, 0, (uint64)ti_want, 0, n) == n);
+    assert(!(ip->flags & I_INLINE) == !inl);
+    iunlockput(ip);
+    end_op();
+  }
+  fsstat(&f1);
+  nblk = f1.nballoc - f0.nballoc;
+
+  bstat(&b0);
+  t0 = r_time();
+  for (int i = 0; i < nfiles; i++) {
+    ti_path(path, dir, i, 1);
+    begin_op(MAXOPBLOCKS);
+    assert((ip = namei(path)) != 0);
+    end_op();
+    ilock(ip);
+    n = readi(ip, 0, (uint64)ti_buf, 0, sizeof(ti_buf));
+    iunlock(ip);
+    begin_op(MAXOPBLOCKS);
+    iput(ip);
+    end_op();
+    numpath(ti_want, "tiny file ", i);
+    assert(n == strlen(ti_want) && memcmp(ti_buf, ti_want, n) == 0);
+  }
+  t0 = r_time() - t0;
+  bstat(&b1);
+  for (int p = 0; p < NBPOLICY; p++)
+    nread += b1.miss[p] - b0.miss[p];
+  printf("%s: %ld blocks for %d files, %ld disk reads to read them, "
+         "%ld us per file\n",
+         how, nblk, nfiles, nread, t0 * 1000000 / CYCLES_PER_SEC / nfiles);
+
+  for (int i = 0; i < nfiles; i++) {
+    ti_path(path, dir, i, 1);
+    begin_op(MAXOPBLOCKS);
+    funlink(path);
+    end_op();
+  }
+  return nblk;
+}
+
+void test_inline(void) {
+  struct inode *ip;
+  int nfiles = TI_FILES * BSIZEMIN / BSIZE;
+
+  printf("Testing inline data...\n");
+  assert(ti_round("blocks", "/tc", "/tc/d", nfiles, 0) >= nfiles);
+  // the directories' blocks only.
+  assert(ti_round("inline", "/ti", "/ti/d", TI_FILES, 1) < TI_FILES / 10);
+
+  for (int j = 0; j < sizeof(ti_buf); j++)
+    ti_buf[j] = 'a' + j % 26;
+  ip = lf_create("/tigrow", 1);
+  begin_op(MAXOPBLOCKS);
+  ilock(ip);
+  assert(writei(ip, 0, (uint64)ti_buf, 0, 10) == 10);
+  iunlock(ip);
+  end_op();
+  ilock(ip);
+  assert(pcache_delay(ip, 0, (uint64)ti_buf + 10, 10, NINLINE - 10) ==
+         NINLINE - 10);
+  iunlock(ip);
+  iflush(ip);
+  ilock(ip);
+  assert((ip->flags & I_INLINE) && ip->dsize == NINLINE);
+  assert(pcache_delay(ip, 0, (uint64)ti_buf + NINLINE, NINLINE, 100) == 100);
+  iunlock(ip);
+  iflush(ip);
+  ilock(ip);
+  assert(!(ip->flags & I_INLINE) && ip->dsize == sizeof(ti_buf));
+  assert(count_extents(ip) == 1);
+  assert(readi(ip, 0, (uint64)lf_buf, 0, BSIZE) == sizeof(ti_buf));
+  assert(memcmp(lf_buf, ti_buf, sizeof(ti_buf)) == 0);
+  iunlock(ip);
+  lf_free(ip);
+  printf("Inline data test completed\n");
+}
+
+// Gathered writes: WV_RECS records of a header, a payload and
+// a trailer, from three places in user memory, written with
+// three filewrite() calls each and then with one filewritev().
+// Appends go to the page cache either way; overwrites take a
+// transaction per call, so writev() takes a third as many.
+// Reports us and transactions per record, and checks the files
+// match and that pread()/pwrite() leave f->off alone.
+#define WV_RECS 500
+#define WV_HDR 16
+#define WV_DATA 200
+#define WV_TAIL 8
+#define WV_REC (WV_HDR + WV_DATA + WV_TAIL)
+
+static struct iovec wv_iov[3] = {
+    {0, WV_HDR}, {256, WV_DATA}, {1024, WV_TAIL}};
+
+// Returns the transactions taken.
+static uint64 wv_round(char *how, struct file *f, int vec) {
+  struct logstat s0, s1;
+  uint64 t0;
+
+  f->off = 0;
+  logstat(&s0);
+  t0 = r_time();
+  for (int r = 0; r < WV_RECS; r++) {
+    if (vec) {
+      assert(filewritev(f, wv_iov, 3, 0) == WV_REC);
+    } else {
+      for (int i = 0; i < 3; i++)
+        assert(filewrite(f, wv_iov[i].base, wv_iov[i].len) == wv_iov[i].len);
+    }
+  }
+  t0 = r_time() - t0;
+  logstat(&s1);
+  printf("%s: %ld us, %ld transactions per 100 records\n", how,
+         t0 * 1000000 / CYCLES_PER_SEC / WV_RECS,
+         (s1.nop - s0.nop) * 100 / WV_RECS);
+  assert(f->off == WV_RECS * WV_REC);
+  return s1.nop - s0.nop;
+}
+
+void test_writev(void) {
+  struct proc *p = myproc();
+  struct logstat s0, s1;
+  struct inode *ip[2];
+  struct file *f[2];
+  struct iovec iov;
+  char buf[8];
+  uint off;
+
+  printf("Testing readv/writev...\n");
+  assert(uvmalloc(p->pagetable, 0, PAGESIZE, PTE_R | PTE_W | PTE_U) ==
+         PAGESIZE);
+  for (int j = 0; j < PAGESIZE; j++)
+    lf_buf[j] = j < 256 ? 'h' : j < 1024 ? 'p' : 't';
+  assert(copyout(p->pagetable, 0, lf_buf, PAGESIZE) == 0);
+
+  for (int k = 0; k < 2; k++) {
+    ip[k] = lf_create(k ? "/wv1" : "/wv3", 1);
+    assert((f[k] = filealloc()) != 0);
+    f[k]->type = FD_INODE;
+    f[k]->ip = idup(ip[k]);
+    f[k]->readable = 1;
+    f[k]->writable = 1;
+  }
+  wv_round("append, 3 writes", f[0], 0);
+  wv_round("append, writev", f[1], 1);
+  iflush(ip[0]);
+  iflush(ip[1]);
+  uint64 n3 = wv_round("overwrite, 3 writes", f[0], 0);
+  uint64 n1 = wv_round("overwrite, writev", f[1], 1);
+  assert(n3 >= 3 * WV_RECS && n1 <= WV_RECS);
+
+  // both hold the same records; read them back a record at a
+  // time, scattered the way they were gathered.
+  for (int k = 0; k < 2; k++) {
+    f[k]->off = 0;
+    for (int r = 0; r < WV_RECS; r++) {
+      assert(filereadv(f[k], wv_iov, 3, 0) == WV_REC);
+      assert(copyin(p->pagetable, lf_buf, 0, PAGESIZE) == 0);
+      for (int j = 0; j < PAGESIZE; j++)
+        assert(lf_buf[j] == (j < 256 ? 'h' : j < 1024 ? 'p' : 't'));
+    }
+    assert(filereadv(f[k], wv_iov, 3, 0) == 0);
+  }
+
+  // pwrite() and pread() in the middle of the file, one
+  // transaction, with f->off where it was.
+  f[1]->off = 7;
+  assert(copyout(p->pagetable, 2048, "XYZ", 3) == 0);
+  iov.base = 2048;
+  iov.len = 3;
+  off = WV_REC + 1;
+  logstat(&s0);
+  assert(filewritev(f[1], &iov, 1, &off) == 3);
+  logstat(&s1);
+  assert(s1.nop - s0.nop == 1 && off == WV_REC + 4 && f[1]->off == 7);
+  iov.base = 3072;
+  iov.len = 5;
+  off = WV_REC;
+  assert(filereadv(f[1], &iov, 1, &off) == 5);
+  assert(off == WV_REC + 5 && f[1]->off == 7);
+  assert(copyin(p->pagetable, buf, 3072, 5) == 0);
+  assert(memcmp(buf, "hXYZh", 5) == 0);
+
+  for (int k = 0; k < 2; k++) {
+    fileclose(f[k]);
+    lf_free(ip[k]);
+  }
+  uvmdealloc(p->pagetable, PAGESIZE, 0);
+  printf("Readv/writev test completed\n");
+}
+
+// sendfile(): a SF_SIZE file copied into a pipe that another
+// process drains, first a page at a time through user memory
+// with fileread() and filewrite(), then with filesend(). The
+// reader checks the block tags that come out of the pipe.
+// Reports MB/s for each. Then filesend() copies the file to
+// another one, at an offset that leaves in->off alone.
+#define SF_SIZE (1024 * 1024)
+
+static struct file *sf_rf; // the pipe's read end
+static uint sf_n;          // bytes the reader got
+static char sf_buf[BSIZEMAX];
+
+static void sf_reader(void) {
+  int have = 0, r;
+
+  sf_n = 0;
+  while ((r = piperead(sf_rf->pipe, 0, (uint64)sf_buf + have,
+                       BSIZE - have)) > 0) {
+    if ((have += r) < BSIZE)
+      continue;
+    assert(*(uint *)sf_buf == sf_n / BSIZE);
+    sf_n += BSIZE;
+    have = 0;
+  }
+  sf_n += have;
+  fileclose(sf_rf);
+}
+
+static void sf_round(char *how, struct file *in, int send) {
+  struct file *wf;
+  uint64 t0;
+  int n;
+
+  in->off = 0;
+  assert(pipealloc(&sf_rf, &wf) == 0);
+  t0 = r_time();
+  assert(kthread_create(sf_reader) > 0);
+  if (send) {
+    assert(filesend(wf, in, 0, SF_SIZE) == SF_SIZE);
+  } else {
+    while ((n = fileread(in, 0, PAGESIZE)) > 0)
+      assert(filewrite(wf, 0, n) == n);
+  }
+  fileclose(wf);
+  wait(0);
+  t0 = r_time() - t0;
+  assert(sf_n == SF_SIZE && in->off == SF_SIZE);
+  printf("%s: %ld MB/s\n", how,
+         (uint64)(SF_SIZE / 1024) * CYCLES_PER_SEC / 1024 / (t0 ? t0 : 1));
+}
+
+void test_sendfile(void) {
+  struct proc *p = myproc();
+  struct inode *ip, *op;
+  struct file *in, *out;
+  uint off;
+
+  printf("Testing sendfile...\n");
+  ip = lf_create("/sfin", 1);
+  lf_write(ip, SF_SIZE);
+  assert(uvmalloc(p->pagetable, 0, PAGESIZE, PTE_R | PTE_W | PTE_U) ==
+         PAGESIZE);
+  assert((in = filealloc()) != 0);
+  in->type = FD_INODE;
+  in->ip = idup(ip);
+  in->readable = 1;
+  in->writable = 0;
+
+  sf_round("read and write", in, 0);
+  sf_round("sendfile", in, 1);
+
+  op = lf_create("/sfout", 1);
+  assert((out = filealloc()) != 0);
+  out->type = FD_INODE;
+  out->ip = idup(op);
+  out->off = 0;
+  out->readable = 0;
+  out->writable = 1;
+  in->off = 7;
+  off = 0;
+  assert(filesend(out, in, &off, SF_SIZE + 100) == SF_SIZE);
+  assert(off == SF_SIZE && in->off == 7 && out->off == SF_SIZE);
+  assert(filesend(out, in, &off, 100) == 0);
+  iflush(op);
+  lf_read(op, SF_SIZE, 16 * BSIZE, 0);
+
+  fileclose(out);
+  fileclose(in);
+  uvmdealloc(p->pagetable, PAGESIZE, 0);
+  lf_free(op);
+  lf_free(ip);
+  printf("Sendfile test completed\n");
+}
+
+// Crash recovery, across two boots of the same fs.img. The first
+// boot rewrites a set of files, one transaction each, with a new
+// pattern, after telling the disk to drop every write past a
+// random point, and then stops. The next boot recovers the log
+// and checks that each file holds either the old pattern or the
+// new one, never a mix. A marker file keeps the round and phase.
+#define CR_FILES 8
+#define CR_SIZE (2 * BSIZE)
+
+struct crash_marker {
+  int round; // rewrites so far
+  int phase; // 1 while the round's rewrite is waiting to be checked
+};
+
+static char cr_buf[2 * BSIZEMAX];
+
+static char cr_byte(int round, int file, int off) {
+  return round == 0 ? 0 : (char)(round * 31 + file * 7 + off / 100);
+}
+
+// Read or write the marker, each in its own transaction.
+static void cr_marker(struct crash_marker *m, int write) {
+  begin_op(LINKOPBLOCKS);
+  struct inode *ip = fcreate("/crashtest", T_FILE);
+  assert(ip != 0);
+  if (write) {
+    assert(writei(ip, 0, (uint64)m, 0, sizeof(*m)) == sizeof(*m));
+  } else if (readi(ip, 0, (uint64)m, 0, sizeof(*m)) != sizeof(*m)) {
+    m->round = 0; // first run on this image
+    m->phase = 0;
+  }
+  iunlockput(ip);
+  end_op();
+}
+
+void test_log_crash(void) {
+  struct crash_marker m;
+  char path[16];
+
+  printf("Testing log crash recovery...\n");
+  cr_marker(&m, 0);
+
+  if (m.phase == 0) {
+    m.round++;
+    m.phase = 1;
+    cr_marker(&m, 1);
+
+    int after = r_time() % (CR_FILES * 10);
+    virtio_disk_crash(after);
+    for (int i = 0; i < CR_FILES; i++) {
+      for (int j = 0; j < CR_SIZE; j++)
+        cr_buf[j] = cr_byte(m.round, i, j);
+      make_path(path, "cr", 0, i);
+      begin_op(LINKOPBLOCKS);
+      struct inode *ip = fcreate(path, T_FILE);
+      assert(ip != 0);
+      assert(writei(ip, 0, (uint64)cr_buf, 0, CR_SIZE) == CR_SIZE);
+      iunlockput(ip);
+      end_op();
+    }
+    printf("round %d: disk cut off after %d blocks, "
+           "boot again to check recovery\n",
+           m.round, after);
+    return;
+  }
+
+  for (int i = 0; i < CR_FILES; i++) {
+    make_path(path, "cr", 0, i);
+    int round = m.round - 1;
+    int n = 0;
+    begin_op(MAXOPBLOCKS);
+    struct inode *ip = namei(path);
+    if (ip != 0) {
+      ilock(ip);
+      n = readi(ip, 0, (uint64)cr_buf, 0, CR_SIZE);
+      iunlockput(ip);
+    }
+    end_op();
+    if (n > 0 && cr_buf[0] == cr_byte(m.round, i, 0))
+      round = m.round;
+    assert(n == (round == 0 ? 0 : CR_SIZE));
+    for (int j = 0; j < n; j++)
+      assert(cr_buf[j] == cr_byte(round, i, j));
+  }
+  m.phase = 0;
+  cr_marker(&m, 1);
+  printf("round %d: recovered files intact\n", m.round);
+  printf("Log crash recovery test completed\n");
+}
+
+static void fs_test_main(void) {
+  fsinit(ROOTDEV);
+  test_group_commit();
+  test_log_concurrency();
+  test_checkpoint();
+  test_large_file();
+  test_bsize();
+  test_pcache();
+  test_delalloc();
+  test_writeback();
+  test_bcache();
+  test_mmap();
+  test_indirect();
+  test_balloc();
+  test_ialloc();
+  test_iget();
+  test_dcache();
+  test_bigdir();
+  test_dirscan();
+  test_inline();
+  test_writev();
+  test_sendfile();
+  test_log_crash();
+}
+
+void test_filesystem(void) {
+  binit();
+  iinit();
+  fileinit();
+  virtio_disk_init();
+  if (kthread_create(fs_test_main) < 0)
+    panic("test_filesystem");
+  scheduler();
+}
@@ -105,6 +105,15 @@ extern uint64 sys_mkdir(void);
 extern uint64 sys_mknod(void);
 extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_bstat(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_sendfile(void);
 
 // 自定义系统调用（保留）
 // extern uint64 sys_hello(void);
@@ -121,7 +130,10 @@ static uint64 (*syscalls[])(void) = {
     [SYS_read] sys_read,     [SYS_open] sys_open,       [SYS_close] sys_close,
     [SYS_fstat] sys_fstat,   [SYS_pipe] sys_pipe,       [SYS_dup] sys_dup,
     [SYS_chdir] sys_chdir,   [SYS_mkdir] sys_mkdir,     [SYS_mknod] sys_mknod,
-    [SYS_unlink] sys_unlink, [SYS_link] sys_link,
+    [SYS_unlink] sys_unlink, [SYS_link] sys_link,     [SYS_mmap] sys_mmap,
+    [SYS_munmap] sys_munmap, [SYS_fsync] sys_fsync,   [SYS_bstat] sys_bstat,
+    [SYS_readv] sys_readv,   [SYS_writev] sys_writev, [SYS_pread] sys_pread,
+    [SYS_pwrite] sys_pwrite, [SYS_sendfile] sys_sendfile,
 };
 
 // 系统调用名称 for 调试
@@ -132,7 +144,10 @@ static char *syscall_names[] = {
     [SYS_read] "read",     [SYS_open] "open",       [SYS_close] "close",
     [SYS_fstat] "fstat",   [SYS_pipe] "pipe",       [SYS_dup] "dup",
     [SYS_chdir] "chdir",   [SYS_mkdir] "mkdir",     [SYS_mknod] "mknod",
-    [SYS_unlink] "unlink", [SYS_link] "link",
+    [SYS_unlink] "unlink", [SYS_link] "link",     [SYS_mmap] "mmap",
+    [SYS_munmap] "munmap", [SYS_fsync] "fsync",     [SYS_bstat] "bstat",
+    [SYS_readv] "readv",   [SYS_writev] "writev", [SYS_pread] "pread",
+    [SYS_pwrite] "pwrite", [SYS_sendfile] "sendfile",
 };
 
 /*
@@ -38,11 +38,20 @@
 #define SYS_mknod   18  // 创建设备文件或管道
 #define SYS_unlink  19  // 删除文件
 #define SYS_link    20  // 创建硬链接
+#define SYS_mmap    21  // 映射文件或匿名内存
+#define SYS_munmap  22  // 解除映射
+#define SYS_fsync   23  // 把文件写回磁盘
+#define SYS_bstat   24  // 块缓存统计
+#define SYS_readv   25  // 分散读
+#define SYS_writev  26  // 聚集写
+#define SYS_pread   27  // 指定偏移读
+#define SYS_pwrite  28  // 指定偏移写
+#define SYS_sendfile 29 // 文件间直接拷贝
 
 // 自定义系统调用（保留）
 // #define SYS_hello   11   // say hello
 
 // 系统调用总数 用于边界检查
-#define NSYSCALL    21
+#define NSYSCALL    30
 
 #endif // SYSCALL_H
\ No newline at end of file
@@ -4,6 +4,7 @@
 // user code, and calls into file.c and fs.c.
 //
 
+#include "../fs/buf.h"
 #include "../fs/file.h"
 #include "../fs/fs.h"
 #include "../fs/fcntl.h"
@@ -57,7 +58,7 @@ uint64 sys_link(void) {
   if (argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(LINKOPBLOCKS);
   if ((ip = namei(old)) == 0) {
     end_op();
     return -1;
@@ -97,20 +98,6 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int isdirempty(struct inode *dp) {
-  int off;
-  struct dirent de;
-
-  for (off = 2 * sizeof(de); off < dp->size; off += sizeof(de)) {
-    if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if (de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 // Unlink a file or directory.
 uint64 sys_unlink(void) {
   struct inode *ip, *dp;
@@ -121,7 +108,7 @@ uint64 sys_unlink(void) {
   if (argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   if ((dp = nameiparent(path, name)) == 0) {
     end_op();
     return -1;
@@ -147,6 +134,7 @@ uint64 sys_unlink(void) {
   memset(&de, 0, sizeof(de));
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   if (ip->type == T_DIR) {
     dp->nlink--;
     iupdate(dp);
@@ -186,7 +174,7 @@ static struct inode *create(char *path, short type, short major, short minor) {
     return 0;
   }
 
-  if ((ip = ialloc(dp->dev, type)) == 0) {
+  if ((ip = ialloc(dp->dev, type, dp->inum)) == 0) {
     iunlockput(dp);
     return 0;
   }
@@ -237,7 +225,7 @@ uint64 sys_open(void) {
   if ((n = argstr(0, path, MAXPATH)) < 0)
     return -1;
 
-  begin_op();
+  begin_op((omode & O_CREATE) ? LINKOPBLOCKS : MAXOPBLOCKS);
 
   if (omode & O_CREATE) {
     ip = create(path, T_FILE, 0, 0);
@@ -298,7 +286,7 @@ uint64 sys_mkdir(void) {
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op(LINKOPBLOCKS);
   if (argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0) {
     end_op();
     return -1;
@@ -314,7 +302,7 @@ uint64 sys_mknod(void) {
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op(LINKOPBLOCKS);
   argint(1, &major);
   argint(2, &minor);
   if ((argstr(0, path, MAXPATH)) < 0 ||
@@ -333,7 +321,7 @@ uint64 sys_chdir(void) {
   struct inode *ip;
   struct proc *p = myproc();
 
-  begin_op();
+  begin_op(MAXOPBLOCKS);
   if (argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
     end_op();
     return -1;
@@ -417,3 +405,149 @@ uint64 sys_pipe(void) {
   }
   return 0;
 }
+
+// Map a file, or anonymous memory.
+// mmap(addr, len, prot, flags, fd, off)
+uint64 sys_mmap(void) {
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if (len <= 0 || off < 0)
+    return -1;
+  if (!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+// munmap(addr, len)
+uint64 sys_munmap(void) {
+  uint64 addr;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  if (len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+// fsync(fd)
+uint64 sys_fsync(void) {
+  struct file *f;
+
+  if (argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+// Fetch the segments of readv() or writev(): arguments n and
+// n + 1 are their user address and count. -1 if there are more
+// than NIOV, or they add up to more than fits an int.
+static int argiov(int n, struct iovec *iov, int *pcnt) {
+  uint64 addr, tot = 0;
+  int cnt;
+
+  argaddr(n, &addr);
+  argint(n + 1, &cnt);
+  if (cnt < 0 || cnt > NIOV)
+    return -1;
+  if (copyin(myproc()->pagetable, (char *)iov, addr, cnt * sizeof(*iov)) < 0)
+    return -1;
+  for (int i = 0; i < cnt; i++) {
+    if (iov[i].len > 0x7fffffff || (tot += iov[i].len) > 0x7fffffff)
+      return -1;
+  }
+  *pcnt = cnt;
+  return 0;
+}
+
+// readv(fd, iov, iovcnt)
+uint64 sys_readv(void) {
+  struct iovec iov[NIOV];
+  struct file *f;
+  int cnt;
+
+  if (argfd(0, 0, &f) < 0 || argiov(1, iov, &cnt) < 0)
+    return -1;
+  return filereadv(f, iov, cnt, 0);
+}
+
+// writev(fd, iov, iovcnt)
+uint64 sys_writev(void) {
+  struct iovec iov[NIOV];
+  struct file *f;
+  int cnt;
+
+  if (argfd(0, 0, &f) < 0 || argiov(1, iov, &cnt) < 0)
+    return -1;
+  return filewritev(f, iov, cnt, 0);
+}
+
+// pread(fd, buf, n, off): read at off, leaving the file offset.
+uint64 sys_pread(void) {
+  struct iovec iov;
+  struct file *f;
+  int n, off;
+  uint o;
+
+  argaddr(1, &iov.base);
+  argint(2, &n);
+  argint(3, &off);
+  if (n < 0 || off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  iov.len = n;
+  o = off;
+  return filereadv(f, &iov, 1, &o);
+}
+
+// pwrite(fd, buf, n, off): write at off, leaving the file offset.
+uint64 sys_pwrite(void) {
+  struct iovec iov;
+  struct file *f;
+  int n, off;
+  uint o;
+
+  argaddr(1, &iov.base);
+  argint(2, &n);
+  argint(3, &off);
+  if (n < 0 || off < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  iov.len = n;
+  o = off;
+  return filewritev(f, &iov, 1, &o);
+}
+
+// sendfile(out_fd, in_fd, off, n): copy n bytes of in_fd from
+// off, or from its offset if off is -1, to out_fd.
+uint64 sys_sendfile(void) {
+  struct file *out, *in;
+  int n, off;
+  uint o;
+
+  argint(2, &off);
+  argint(3, &n);
+  if (argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 || off < -1)
+    return -1;
+  if (off == -1)
+    return filesend(out, in, 0, n);
+  o = off;
+  return filesend(out, in, &o, n);
+}
+
+// bstat(struct bstat *st): the buffer cache's counters.
+uint64 sys_bstat(void) {
+  struct bstat st;
+  uint64 addr;
+
+  argaddr(0, &addr);
+  bstat(&st);
+  if (copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
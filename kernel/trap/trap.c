@@ -96,18 +96,16 @@ uint64 usertrap(void) {
     // ok
   } else if (scause == 15 || scause == 13) {
     // 页面错误：15=存储页面错误，13=加载页面错误
+    // 懒分配、写时复制和 mmap 区域的页面由 vmfault() 处理
     uint64 stval = r_stval(); // 导致错误的虚拟地址
 
     int is_write = (scause == 15) ? 1 : 0;
-    if (vmfault(p->pagetable, stval, is_write) != 0) {
+    if (vmfault(p->pagetable, stval, is_write) == 0) {
       // 页面错误处理失败
       printf("usertrap(): page fault at 0x%lx\n", stval);
-      // 杀死进程或采取其他措施
+      panic("page fault");
     }
 
-    printf("usertrap(): page fault at 0x%lx\n", stval);
-    panic("page fault");
-
   } else {
     // 未知的陷阱类型
     printf("usertrap(): unexpected scause 0x%lx\n", scause);
@@ -247,7 +245,7 @@ int devintr(void) {
     if (irq == UART0_IRQ) {
       // uartintr();
     } else if (irq == VIRTIO0_IRQ) {
-      // virtio_disk_intr();
+      virtio_disk_intr();
     } else if (irq) {
       printf("unexpected interrupt irq=%d\n", irq);
     }
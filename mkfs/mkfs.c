@@ -0,0 +1,342 @@
+// mkfs: build a file system image for the kernel (kernel/fs/fs.h).
+//
+// usage: mkfs [-b bsize] [-s blocks] [-i inodes] fs.img files...
+//
+// Lays the disk out as
+//   [ boot | super | log | inodes | free bit map | data ]
+// and puts the files in the root directory. The root directory's
+// blocks come first in the data area, then each file in one
+// extent of consecutive blocks, in the order given, so a new
+// image has no fragmentation at all. A root directory of more
+// than one block is a hashed directory (I_HASHDIR), as the
+// kernel would have made it, with all its leaves at the fewest
+// hash bits that fit the names into them. A file of at most NINLINE
+// bytes goes in its inode instead (I_INLINE), as the kernel
+// would have put it.
+//
+// Everything up to the data area is built in memory and written
+// with one pwrite(); the data area is written in order through
+// an IOBUF-byte buffer. The rest of the image has to read as
+// zeros, and ftruncate() leaves it a hole, so formatting takes
+// about as long for a 1GB image as for a small one.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kernel/fs/fs.h"
+#include "kernel/include/param.h"
+
+#define NINODES 16384   // default number of inodes
+#define IOBUF (1 << 20) // bytes per write of the data area
+
+uint crc32c(uint crc, const void *p, uint n); // kernel/lib/crc.c
+
+uint fsbsize = BSIZEMIN; // BSIZE, set by -b
+
+static int fsfd;
+static struct superblock sb;
+static char *meta;   // blocks [0, nmeta): boot, super, log, inodes, bitmap
+static uint nmeta;
+static char *iobuf;  // data area bytes not yet written
+static uint iolen;
+static uint64 iooff; // image offset of iobuf
+
+static void die(const char *s) {
+  fprintf(stderr, "mkfs: %s\n", s);
+  exit(1);
+}
+
+// Block b, which must be below nmeta, in memory.
+static char *mblock(uint b) { return meta + (uint64)b * BSIZE; }
+
+static struct dinode *dinode(uint inum) {
+  return (struct dinode *)mblock(IBLOCK(inum, sb)) + inum % IPB;
+}
+
+static void ioflush(void) {
+  if (iolen > 0 && pwrite(fsfd, iobuf, iolen, iooff) != iolen)
+    die("write failed");
+  iooff += iolen;
+  iolen = 0;
+}
+
+// Append n bytes at p to the data area.
+static void ioput(const void *p, uint n) {
+  uint m;
+
+  for (; n > 0; n -= m, p = (const char *)p + m) {
+    if (iolen == IOBUF)
+      ioflush();
+    m = IOBUF - iolen < n ? IOBUF - iolen : n;
+    memmove(iobuf + iolen, p, m);
+    iolen += m;
+  }
+}
+
+// Append the rest of the file open on fd, straight into iobuf.
+// Returns the number of bytes.
+static uint64 iocopy(int fd) {
+  uint64 tot = 0;
+  ssize_t n;
+
+  for (;;) {
+    if (iolen == IOBUF)
+      ioflush();
+    if ((n = read(fd, iobuf + iolen, IOBUF - iolen)) < 0)
+      die("read failed");
+    if (n == 0)
+      return tot;
+    iolen += n;
+    tot += n;
+  }
+}
+
+// Fill the data area with zeros up to the next block boundary.
+static void iopad(void) {
+  uint n = (BSIZE - (iooff + iolen) % BSIZE) % BSIZE;
+
+  if (iolen + n > IOBUF)
+    ioflush();
+  memset(iobuf + iolen, 0, n);
+  iolen += n;
+}
+
+// Make inode inum of type type, size bytes in the nblk blocks
+// from start.
+static void mkinode(uint inum, short type, uint size, uint start, uint nblk) {
+  struct dinode *dip = dinode(inum);
+
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  dip->nlink = 1;
+  dip->size = size;
+  dip->flags = I_EXTENTS;
+  if (nblk > 0) {
+    dip->ext.e[0].start = start;
+    dip->ext.e[0].len = nblk;
+  }
+}
+
+// The name a file gets in the root directory: its last path
+// element, without the leading '_' of user programs.
+static const char *fsname(const char *path) {
+  const char *s = strrchr(path, '/');
+
+  s = s ? s + 1 : path;
+  if (*s == '_')
+    s++;
+  return s;
+}
+
+// Hash of a name, as dirhash() in kernel/fs/fs.c.
+static uint dirhash(const char *name) {
+  return crc32c(0, name, strnlen(name, DIRSIZ));
+}
+
+// The fewest hash bits that leave no leaf of a hashed root
+// directory with more names than its DPB - 1 slots, or -1 if
+// HTMAXDEPTH bits do not.
+static int htdepth(char **files, uint nfiles) {
+  uint *n;
+  int d, full;
+
+  for (d = 0; d <= HTMAXDEPTH; d++) {
+    if ((n = calloc(1 << d, sizeof(uint))) == 0)
+      die("out of memory");
+    full = 0;
+    for (uint i = 0; i < nfiles && !full; i++)
+      full = ++n[dirhash(fsname(files[i])) & ((1 << d) - 1)] > DPB - 1;
+    free(n);
+    if (!full)
+      return d;
+  }
+  return -1;
+}
+
+// The root directory's ndirblk blocks, in memory: block 0 holds
+// "." and "..", and the names follow them, or, if depth is not
+// -1, go in hashed leaves (see fs.h) after the table, leaf p
+// holding the names whose hashes' low depth bits are p.
+static char *mkroot(char **files, uint nfiles, int depth, uint ndirblk) {
+  struct dirent *de;
+  struct htslot *hs;
+  char *dir;
+  uint p, q, j;
+
+  if ((dir = calloc(ndirblk, BSIZE)) == 0)
+    die("out of memory");
+  de = (struct dirent *)dir;
+  de[0].inum = de[1].inum = ROOTINO;
+  strncpy(de[0].name, ".", DIRSIZ);
+  strncpy(de[1].name, "..", DIRSIZ);
+  if (depth < 0) {
+    for (uint i = 0; i < nfiles; i++) {
+      de[2 + i].inum = ROOTINO + 1 + i;
+      strncpy(de[2 + i].name, fsname(files[i]), DIRSIZ);
+    }
+    return dir;
+  }
+
+  hs = (struct htslot *)(dir + BSIZE);
+  hs[0].v[0] = HTMAGIC;
+  hs[0].v[1] = depth;
+  for (p = 0; p < (1 << depth); p++) {
+    q = p + HTPERSLOT; // the header comes first
+    hs = (struct htslot *)(dir + (1 + q / (DPB * HTPERSLOT)) * BSIZE);
+    hs[q / HTPERSLOT % DPB].v[q % HTPERSLOT] = HTBLOCKS + 1 + p;
+    hs = (struct htslot *)(dir + (HTBLOCKS + 1 + p) * BSIZE);
+    hs->v[0] = HTMAGIC;
+    hs->v[1] = depth;
+  }
+  for (uint i = 0; i < nfiles; i++) {
+    p = dirhash(fsname(files[i])) & ((1 << depth) - 1);
+    de = (struct dirent *)(dir + (HTBLOCKS + 1 + p) * BSIZE);
+    for (j = 1; de[j].inum != 0; j++)
+      ;
+    de[j].inum = ROOTINO + 1 + i;
+    strncpy(de[j].name, fsname(files[i]), DIRSIZ);
+  }
+  return dir;
+}
+
+static void usage(void) {
+  die("usage: mkfs [-b bsize] [-s blocks] [-i inodes] fs.img files...");
+}
+
+int main(int argc, char *argv[]) {
+  uint size = 0, ninodes = NINODES, nlog = LOGSIZE;
+  uint boot, ninodeblocks, nbitmap, nfiles, ndirblk, dirsize, next;
+  uint64 nblk;
+  struct stat st;
+  char **files, *dir;
+  int c, fd, depth = -1;
+
+  while ((c = getopt(argc, argv, "b:s:i:")) != -1) {
+    switch (c) {
+    case 'b':
+      fsbsize = atoi(optarg);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    case 'i':
+      ninodes = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc)
+    usage();
+  if (BSIZE < BSIZEMIN || BSIZE > BSIZEMAX || (BSIZE & (BSIZE - 1)) != 0)
+    die("block size must be 1024, 2048, 4096 or 8192");
+  files = argv + optind + 1;
+  nfiles = argc - optind - 1;
+  if (size == 0) // FSSIZE 1KB blocks' worth
+    size = (uint64)FSSIZE * BSIZEMIN / BSIZE;
+  if (ninodes < nfiles + 2)
+    die("too few inodes");
+
+  boot = BSIZE > SBOFFSET ? 1 : 2; // the super block is in block 0 or 1
+  ninodeblocks = ninodes / IPB + 1;
+  nbitmap = size / BPB + 1;
+  nmeta = boot + nlog + ninodeblocks + nbitmap;
+
+  sb.magic = FSMAGIC;
+  sb.size = size;
+  sb.nblocks = size - nmeta;
+  sb.ninodes = ninodes;
+  sb.nlog = nlog;
+  sb.logstart = boot;
+  sb.inodestart = boot + nlog;
+  sb.bmapstart = boot + nlog + ninodeblocks;
+  sb.bsize = BSIZE;
+
+  // check that everything fits before writing anything.
+  nblk = nmeta;
+  for (uint i = 0; i < nfiles; i++) {
+    if (stat(files[i], &st) < 0 || !S_ISREG(st.st_mode))
+      die(files[i]);
+    if (st.st_size > 0xffffffffL)
+      die("file too large");
+    if (strlen(fsname(files[i])) > DIRSIZ)
+      die("file name too long");
+    for (uint j = 0; j < i; j++) {
+      if (strcmp(fsname(files[i]), fsname(files[j])) == 0)
+        die("duplicate file name");
+    }
+    if (st.st_size > NINLINE)
+      nblk += (st.st_size + BSIZE - 1) / BSIZE;
+  }
+  dirsize = (2 + nfiles) * sizeof(struct dirent);
+  ndirblk = 1;
+  if (dirsize > BSIZE) {
+    if ((depth = htdepth(files, nfiles)) < 0)
+      die("too many files for the root directory");
+    ndirblk = HTBLOCKS + 1 + (1 << depth);
+    dirsize = ndirblk * BSIZE;
+  }
+  nblk += ndirblk;
+  if (nblk > size)
+    die("image too small");
+
+  if ((meta = calloc(nmeta, BSIZE)) == 0 || (iobuf = malloc(IOBUF)) == 0)
+    die("out of memory");
+  if ((fsfd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+    die(argv[optind]);
+  if (ftruncate(fsfd, (off_t)size * BSIZE) < 0)
+    die("ftruncate failed");
+
+  // the root directory, in the first data blocks.
+  iooff = (uint64)nmeta * BSIZE;
+  mkinode(ROOTINO, T_DIR, dirsize, nmeta, ndirblk);
+  if (depth >= 0)
+    dinode(ROOTINO)->flags |= I_HASHDIR;
+  dir = mkroot(files, nfiles, depth, ndirblk);
+  ioput(dir, ndirblk * BSIZE);
+  free(dir);
+
+  // the files, one after another.
+  next = nmeta + ndirblk;
+  for (uint i = 0; i < nfiles; i++) {
+    if ((fd = open(files[i], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+      die(files[i]);
+    if (st.st_size > 0 && st.st_size <= NINLINE) {
+      struct dinode *dip = dinode(ROOTINO + 1 + i);
+      mkinode(ROOTINO + 1 + i, T_FILE, st.st_size, 0, 0);
+      if (read(fd, dip->addrs, st.st_size) != st.st_size)
+        die("read failed");
+      dip->flags |= I_INLINE;
+      close(fd);
+      continue;
+    }
+    uint64 n = iocopy(fd);
+    close(fd);
+    iopad();
+    nblk = (n + BSIZE - 1) / BSIZE;
+    mkinode(ROOTINO + 1 + i, T_FILE, n, next, nblk);
+    next += nblk;
+  }
+  ioflush();
+  if (next > size)
+    die("image too small"); // a file grew
+
+  // mark the blocks in use, and write the metadata.
+  for (uint b = 0; b < next; b++)
+    mblock(sb.bmapstart + b / BPB)[b % BPB / 8] |= 1 << (b % 8);
+  memmove(meta + SBOFFSET, &sb, sizeof(sb));
+  if (pwrite(fsfd, meta, (uint64)nmeta * BSIZE, 0) != (uint64)nmeta * BSIZE)
+    die("write failed");
+  if (close(fsfd) < 0)
+    die("close failed");
+
+  printf("block size %d, %d blocks: boot %d, log %d, inodes %d, bitmap %d, "
+         "data %d (%d in use)\n",
+         BSIZE, size, boot, nlog, ninodeblocks, nbitmap, sb.nblocks,
+         next - nmeta);
+  return 0;
+}
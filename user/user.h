@@ -14,6 +14,14 @@ typedef unsigned short ushort;
 typedef unsigned char  uchar;
 typedef unsigned long  uint64;
 
+struct bstat;
+
+// readv() 和 writev() 的一段缓冲区, 与内核的 struct iovec 相同
+struct iovec {
+  uint64 base; // 用户地址
+  uint64 len;  // 字节数
+};
+
 // 系统调用声明
 // 进程相关
 int fork(void);
@@ -44,6 +52,17 @@ int dup(int fd);
 int pipe(int *fds);
 int fstat(int fd, void *st);
 int mknod(const char *path, short major, short minor);
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
+int pread(int fd, void *buf, int n, int off);
+int pwrite(int fd, const void *buf, int n, int off);
+int sendfile(int out_fd, int in_fd, int off, int n);
+int fsync(int fd);
+int bstat(struct bstat *st);
+
+// 内存映射 (flags 见 kernel/fs/fcntl.h)
+void *mmap(void *addr, int len, int prot, int flags, int fd, int off);
+int munmap(void *addr, int len);
 
 // 自定义系统调用
 void hello(void);
@@ -61,5 +61,16 @@ entry("dup");
 entry("pipe");
 entry("fstat");
 entry("mknod");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("sendfile");
+entry("fsync");
+entry("bstat");
+
+# 内存映射
+entry("mmap");
+entry("munmap");
 
 entry("hello");  # 自定义系统调用
\ No newline at end of file